@@ -0,0 +1,35 @@
+#!/usr/bin/env Rscript
+
+# read a binary column file, as written by jplace-diversity and scrapp-diversity with --binary,
+# into a data frame. each column is read with a single readBin call.
+read_columns <- function( file ) {
+  con <- file( file, "rb" )
+  on.exit( close( con ) )
+
+  if( readBin( con, "character", 1 ) != "DIVCOLS" ) {
+    stop( "not a column file: ", file )
+  }
+  header <- readBin( con, "integer", 3, size=4, endian="little" )
+  if( header[1] != 1 ) {
+    stop( "unsupported column file version ", header[1], ": ", file )
+  }
+  ncol <- header[2]
+  nrow <- header[3]
+
+  types <- integer( ncol )
+  names <- character( ncol )
+  for( i in seq_len( ncol ) ) {
+    types[i] <- readBin( con, "integer", 1, size=4, endian="little" )
+    names[i] <- readBin( con, "character", 1 )
+  }
+
+  columns <- lapply( types, function( type ) {
+    if( type == 0 ) {
+      readBin( con, "character", nrow )
+    } else {
+      readBin( con, "double", nrow, size=8, endian="little" )
+    }
+  })
+  names( columns ) <- names
+  as.data.frame( columns, stringsAsFactors=FALSE, check.names=FALSE )
+}
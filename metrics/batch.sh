@@ -0,0 +1,45 @@
+#!/bin/bash
+
+THREADS=$(nproc)
+
+BASE=$(cd `dirname "${BASH_SOURCE[0]}"`/.. && pwd)
+
+die () {
+    echo >&2 "$@"
+    exit 1
+}
+
+[ "$#" -ge 1 ] || die "specify datasets!"
+
+set -e
+
+# one manifest for all datasets, with the same outputs as bwpd.sh and scrapp_measures.sh,
+# evaluated by a single jplace-diversity process that parses every input file only once.
+MANIFEST=${BASE}/workdir/batch_manifest.txt
+mkdir -p ${BASE}/workdir
+: > ${MANIFEST}
+
+for DS in "$@"; do
+  DATA=${BASE}/datasets/${DS}
+  [ ! -d "${DATA}" ] && die "No such dataset: ${DS}"
+
+  WORKDIR=${BASE}/workdir/${DS}
+  mkdir -p ${WORKDIR}/bwpd
+
+  CHUNKED=${DATA}/place/epa_result.jplace
+  MAPS=${DATA}/data/maps
+  if [ -f "${CHUNKED}" ] && [ -d "${MAPS}" ]; then
+    echo "chunked ${WORKDIR}/bwpd/result.csv ${CHUNKED} ${MAPS}/*" >> ${MANIFEST}
+  else
+    echo "bwpd ${WORKDIR}/bwpd/result.csv ${DATA}/place/samples/*.jplace ${DATA}/place/samples/*.jplace.gz" >> ${MANIFEST}
+  fi
+
+  if [ -d "${WORKDIR}/scrapp_boot_1000" ]; then
+    echo "scrapp ${WORKDIR}/scrapp_boot_1000/result.csv ${WORKDIR}/scrapp_boot_1000/*/summary.newick" >> ${MANIFEST}
+  fi
+done
+
+# wall time in milliseconds of the whole batch
+START=$(date +%s%N)
+${BASE}/bin/jplace-diversity --threads ${THREADS} --manifest ${MANIFEST}
+echo $(( ( $(date +%s%N) - START ) / 1000000 )) > ${BASE}/workdir/batch_runtime_ms.txt
@@ -1,5 +1,7 @@
 #!/bin/bash
 
+THREADS=4
+
 BASE=$(cd `dirname "${BASH_SOURCE[0]}"`/.. && pwd)
 
 die () {
@@ -7,7 +9,7 @@ die () {
     exit 1
 }
 
-[ "$#" -eq 1 ] || die "specify dataset!"
+[ "$#" -ge 1 ] || die "specify dataset! optionally followed by a shard i/N, or by 'merge N' to combine N shards"
 
 DS=$1
 DATA=${BASE}/datasets/${DS}
@@ -17,6 +19,8 @@ DATA=${BASE}/datasets/${DS}
 WORKDIR=${BASE}/workdir/${DS}/bwpd
 
 JPDIR=${DATA}/place/samples
+CHUNKED=${DATA}/place/epa_result.jplace
+MAPS=${DATA}/data/maps
 
 set -e
 shopt -s nullglob
@@ -24,4 +28,29 @@ shopt -s nullglob
 mkdir -p ${WORKDIR}
 cd ${WORKDIR}
 
-${BASE}/bin/jplace-diversity ${JPDIR}/*.jplace > result.csv
+if [ -f "${CHUNKED}" ] && [ -d "${MAPS}" ]; then
+  # evaluate the chunked placement result directly, no need to unchunkify
+  INPUTS=( --chunked ${CHUNKED} ${MAPS}/* )
+else
+  INPUTS=( ${JPDIR}/*.jplace ${JPDIR}/*.jplace.gz )
+fi
+
+# to spread a dataset over several nodes, run each shard i/N separately, then 'merge N'.
+# the shards are balanced by file size, and the merge checks that every sample is there once.
+SUFFIX=""
+SHARD=()
+if [ "$2" == "merge" ]; then
+  OUTPUTS=$(for (( i = 0; i < $3; i++ )); do printf "result.shard%d.csv," $i; done)
+  ${BASE}/bin/jplace-diversity --merge ${OUTPUTS%,} "${INPUTS[@]}" > result.csv
+  exit 0
+elif [ -n "$2" ]; then
+  SUFFIX=".shard${2%/*}"
+  SHARD=( --shard $2 )
+fi
+
+# the parsed samples are cached in samples.bin, so that re-runs do not parse the jplace files again.
+# it is rebuilt when the size or modification time of an input file changes.
+# wall time in milliseconds, for comparison with guppy-fpd.sh
+START=$(date +%s%N)
+${BASE}/bin/jplace-diversity --threads ${THREADS} --cache samples${SUFFIX}.bin "${SHARD[@]}" "${INPUTS[@]}" > result${SUFFIX}.csv
+echo $(( ( $(date +%s%N) - START ) / 1000000 )) > runtime_ms${SUFFIX}.txt
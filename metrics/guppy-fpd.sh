@@ -25,4 +25,7 @@ shopt -s nullglob
 mkdir -p ${WORKDIR}
 cd ${WORKDIR}
 
+# wall time in milliseconds, as reference point for bwpd.sh and diversity-bench
+START=$(date +%s%N)
 guppy fpd --theta 0.0,0.25,0.5,0.75,1.0 --out-dir ${WORKDIR} --csv -o result.csv ${JPDIR}/*.jplace
+echo $(( ( $(date +%s%N) - START ) / 1000000 )) > runtime_ms.txt
@@ -24,6 +24,6 @@ shopt -s nullglob
 mkdir -p ${WORKDIR}
 cd ${WORKDIR}
 
-# export OMP_NUM_THREADS=10
+THREADS=10
 
-${BASE}/bin/scrapp-diversity ${SF} > result.csv
+${BASE}/bin/scrapp-diversity --threads ${THREADS} ${SF} > result.csv
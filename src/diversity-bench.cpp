@@ -0,0 +1,527 @@
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "genesis/genesis.hpp"
+
+#include "diversity/bwpd.hpp"
+#include "diversity/clade_profile.hpp"
+#include "diversity/flat_masses.hpp"
+#include "diversity/flat_tree.hpp"
+#include "diversity/mass_tree_bwpd.hpp"
+#include "diversity/metrics.hpp"
+#include "diversity/options.hpp"
+#include "diversity/parallel.hpp"
+#include "diversity/sparse.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace genesis;
+using namespace genesis::tree;
+using namespace genesis::utils;
+
+// =================================================================================================
+//     Allocation Counting
+// =================================================================================================
+
+static std::atomic< size_t > allocation_count( 0 );
+
+void* operator new( size_t size )
+{
+    ++allocation_count;
+    if( void* ptr = std::malloc( size == 0 ? 1 : size )) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete( void* ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+// =================================================================================================
+//     Synthetic Data
+// =================================================================================================
+
+/**
+ * Random unrooted bifurcating tree with @p leaves leaves (at least 3) in Newick format, that is,
+ * with `2 * leaves - 3` edges, grown by splitting uniformly chosen leaves (Yule process).
+ * Branch lengths are uniform in `[0.001, 0.5)`.
+ *
+ * With @p polytomies > 0, that fraction of the inner edges is contracted, so that their children
+ * are attached to the node above, yielding a multifurcating tree with fewer edges.
+ */
+std::string random_newick( size_t const leaves, double const polytomies, std::mt19937_64& rng )
+{
+    // children per node, with node 0 being the trifurcating root
+    std::vector< std::vector< size_t >> children( 4 );
+    children[0] = { 1, 2, 3 };
+    std::vector< size_t > tips = { 1, 2, 3 };
+    while( tips.size() < leaves ) {
+        std::uniform_int_distribution< size_t > pick( 0, tips.size() - 1 );
+        auto const i = pick( rng );
+        auto const tip = tips[ i ];
+        children[ tip ] = { children.size(), children.size() + 1 };
+        tips[ i ] = children.size();
+        tips.push_back( children.size() + 1 );
+        children.resize( children.size() + 2 );
+    }
+
+    std::bernoulli_distribution contract( polytomies );
+    std::vector< bool > contracted( children.size(), false );
+    for( size_t node = 1; node < children.size(); ++node ) {
+        contracted[ node ] = not children[ node ].empty() and contract( rng );
+    }
+
+    std::uniform_real_distribution< double > branch_length( 0.001, 0.5 );
+    std::ostringstream out;
+    std::function< void( size_t ) > write;
+    std::function< void( size_t, bool& ) > write_children = [&]( size_t const node, bool& first ) {
+        for( auto const child : children[ node ] ) {
+            if( contracted[ child ] ) {
+                write_children( child, first );
+                continue;
+            }
+            out << ( first ? "" : "," );
+            first = false;
+            write( child );
+        }
+    };
+    write = [&]( size_t const node ) {
+        if( children[ node ].empty() ) {
+            out << "t" << node;
+        } else {
+            bool first = true;
+            out << "(";
+            write_children( node, first );
+            out << ")";
+        }
+        if( node != 0 ) {
+            out << ":" << branch_length( rng );
+        }
+    };
+    write( 0 );
+    out << ";";
+    return out.str();
+}
+
+/**
+ * Random normalized masses on @p occupied distinct positions of a tree with @p size edges.
+ */
+SparseMasses random_masses( size_t const size, size_t const occupied, std::mt19937_64& rng )
+{
+    std::vector< size_t > positions( size );
+    for( size_t i = 0; i < size; ++i ) {
+        positions[ i ] = i;
+    }
+    std::uniform_real_distribution< double > mass( 0.0, 1.0 );
+    SparseMasses result;
+    double total = 0.0;
+    for( size_t i = 0; i < occupied; ++i ) {
+        std::uniform_int_distribution< size_t > pick( i, size - 1 );
+        std::swap( positions[ i ], positions[ pick( rng ) ] );
+        result.add( positions[ i ], mass( rng ));
+        total += result.masses.back();
+    }
+    for( auto& m : result.masses ) {
+        m /= total;
+    }
+    normalize_sparse_masses( result );
+    return result;
+}
+
+// =================================================================================================
+//     Pointer-based Baseline
+// =================================================================================================
+
+/**
+ * The mass tree BWPD as it was before the FlatTree, walking the genesis postorder iterator and the
+ * node links directly, with D(i) kept per edge index. This is the baseline that the flat kernels
+ * are compared against, so it deliberately does not build a FlatTree.
+ */
+template< class accumulator_t >
+void PointerMassTreeBWPD( MassTree const& mass_tree, accumulator_t& accumulator )
+{
+    auto const mass_per_edge = mass_tree_mass_per_edge( mass_tree );
+    std::vector< double > per_edge_D( mass_tree.edge_count(), 0.0 );
+
+    for( auto const& it : postorder( mass_tree ) ) {
+        // ensure last edge isn't visited twice
+        if( it.is_last_iteration() ) { continue; }
+
+        auto const& edge = it.edge();
+        if( is_leaf( edge ) ) {
+            continue;
+        }
+
+        // interior edges: sum up the distal and edge masses of all child edges
+        auto const& node = it.node();
+        double distal = 0.0;
+        for( auto link = &node.link().next(); link != &node.link(); link = &link->next() ) {
+            auto const child_index = link->edge().index();
+            distal += per_edge_D[ child_index ] + mass_per_edge[ child_index ];
+
+            if( equals_approx( per_edge_D[ child_index ], 0.0 ) ) {
+                distal_edge_sum( link->edge(), accumulator );
+            }
+        }
+        per_edge_D[ edge.index() ] = distal;
+
+        accumulator.add( edge.data< MassTreeEdgeData >().branch_length, distal );
+    }
+}
+
+// =================================================================================================
+//     Measurement
+// =================================================================================================
+
+struct Measurement
+{
+    double seconds;
+    double allocations;
+};
+
+/**
+ * Median wall time and the mean number of allocations of @p repeats runs of @p run.
+ */
+Measurement measure( size_t const repeats, std::function< void() > const& run )
+{
+    std::vector< double > seconds;
+    size_t allocations = 0;
+    for( size_t r = 0; r < repeats; ++r ) {
+        auto const allocations_before = allocation_count.load();
+        auto const start = std::chrono::steady_clock::now();
+        run();
+        auto const stop = std::chrono::steady_clock::now();
+        allocations += allocation_count.load() - allocations_before;
+        seconds.push_back( std::chrono::duration< double >( stop - start ).count() );
+    }
+    std::sort( seconds.begin(), seconds.end() );
+    return {
+        seconds[ seconds.size() / 2 ],
+        static_cast< double >( allocations ) / static_cast< double >( repeats )
+    };
+}
+
+/**
+ * Sum of the first metric of all samples, which keeps the evaluations from being optimized away,
+ * and allows to check that the kernels agree.
+ */
+double checksum( std::vector< double > const& sink )
+{
+    double result = 0.0;
+    for( auto const value : sink ) {
+        result += value;
+    }
+    return result;
+}
+
+/**
+ * Benchmark results as a JSON array of objects, one per call of add().
+ */
+class JsonResults
+{
+public:
+
+    void add(
+        std::string const& benchmark, size_t const edges, double const occupied_fraction,
+        size_t const samples, Measurement const& measurement, double const checksum
+    ) {
+        std::ostringstream out;
+        out << "    { \"benchmark\": \"" << benchmark << "\""
+            << ", \"edges\": " << edges
+            << ", \"occupied_fraction\": " << occupied_fraction
+            << ", \"samples\": " << samples
+            << ", \"seconds\": " << measurement.seconds
+            << ", \"edges_per_second\": " << static_cast< double >( edges * samples ) / measurement.seconds
+            << ", \"samples_per_second\": " << static_cast< double >( samples ) / measurement.seconds
+            << ", \"allocations_per_sample\": " << measurement.allocations / static_cast< double >( samples )
+            << ", \"checksum\": " << checksum
+            << " }";
+        entries_.push_back( out.str() );
+    }
+
+    void write( std::ostream& out, size_t const threads, size_t const seed, double const polytomies ) const
+    {
+        out << "{\n  \"threads\": " << threads << ",\n  \"seed\": " << seed
+            << ",\n  \"polytomies\": " << polytomies << ",\n  \"results\": [\n";
+        for( size_t i = 0; i < entries_.size(); ++i ) {
+            out << entries_[ i ] << ( i + 1 < entries_.size() ? ",\n" : "\n" );
+        }
+        out << "  ]\n}\n";
+    }
+
+private:
+
+    std::vector< std::string > entries_;
+};
+
+// =================================================================================================
+//     Consistency Checks
+// =================================================================================================
+
+/**
+ * Random rooted FlatTree with @p size edges, built directly in postorder: each new edge either
+ * becomes a leaf, or the parent of the last two or three subtrees. With @p caterpillar, every inner
+ * edge has one leaf child, which gives the longest heavy paths.
+ */
+FlatTree random_flat_tree( size_t const size, bool const caterpillar, std::mt19937_64& rng )
+{
+    std::uniform_real_distribution< double > branch_length( 0.01, 1.0 );
+    std::bernoulli_distribution join( 0.5 );
+    FlatTree result;
+    std::vector< size_t > subtrees;
+    std::vector< size_t > children;
+    for( size_t pos = 0; pos < size; ++pos ) {
+        children.clear();
+        auto const arity = caterpillar ? 2 : 2 + rng() % 2;
+        bool const inner = caterpillar ? ( pos % 2 == 0 and pos > 0 ) : join( rng );
+        if( inner and subtrees.size() >= arity ) {
+            children.assign( subtrees.end() - arity, subtrees.end() );
+            subtrees.resize( subtrees.size() - arity );
+        }
+        result.position.push_back( pos );
+        result.add( pos, branch_length( rng ), children.begin(), children.end() );
+        subtrees.push_back( pos );
+    }
+    return result;
+}
+
+/**
+ * Compare clade_profile() against BWPD() of each clade on its own, with the clade cut out of the
+ * tree as a FlatTree of its own. Returns the largest relative difference over all metrics.
+ */
+double check_clade_profile( size_t const trees, std::mt19937_64& rng, size_t& clades )
+{
+    auto metrics = default_metric_set({ 0.0, 0.25, 0.5, 1.0 });
+    metrics.specs.push_back({ MetricSpec::faith, 0.0, "" });
+    metrics.grid.from  = 0.1;
+    metrics.grid.to    = 0.9;
+    metrics.grid.steps = 5;
+
+    double worst = 0.0;
+    clades = 0;
+    for( size_t t = 0; t < trees; ++t ) {
+        auto const tree = random_flat_tree( 5 + rng() % 60, t % 3 == 0, rng );
+        SparseTree const sparse_tree( tree );
+
+        // leaves only, all edges, or a single edge with all of the mass
+        std::vector< double > masses( tree.size(), 0.0 );
+        for( size_t pos = 0; pos < tree.size(); ++pos ) {
+            if( t % 3 == 0 ? tree.is_leaf( pos ) : rng() % 3 == 0 ) {
+                masses[ pos ] = static_cast< double >( rng() % 5 );
+            }
+        }
+        if( t % 4 == 3 ) {
+            std::fill( masses.begin(), masses.end(), 0.0 );
+            masses[ rng() % tree.size() ] = 1.0;
+        }
+
+        CladeProfile profile;
+        clade_profile( tree, masses, metrics, profile );
+        for( size_t i = 0; i < profile.size(); ++i ) {
+            auto const pos   = profile.positions[ i ];
+            auto const begin = sparse_tree.subtree_begin( pos );
+
+            // the clade, with its top edge of length zero, so that it does not add any terms
+            FlatTree clade;
+            std::vector< double > clade_masses;
+            std::vector< size_t > children;
+            for( auto p = begin; p <= pos; ++p ) {
+                children.clear();
+                for( auto const child : tree.children_of( p ) ) {
+                    children.push_back( child - begin );
+                }
+                clade.position.push_back( p - begin );
+                clade.add( p - begin, p == pos ? 0.0 : tree.branch_length[ p ], children.begin(), children.end() );
+                clade_masses.push_back( p == pos ? 0.0 : masses[ p ] );
+            }
+
+            MetricAccumulator accumulator( metrics );
+            BWPD( clade, clade_masses, profile.clade_mass[ i ], accumulator );
+            auto const expected = accumulator.row();
+            auto const* actual  = profile.row( i, metrics );
+            for( size_t k = 0; k < expected.size(); ++k ) {
+                worst = std::max( worst, std::abs( expected[ k ] - actual[ k ] ) / ( 1.0 + std::abs( expected[ k ] )));
+            }
+            ++clades;
+        }
+    }
+    return worst;
+}
+
+// =================================================================================================
+//     Main
+// =================================================================================================
+
+/**
+ *  Benchmark the BWPD kernels on synthetic trees and masses, output as JSON
+ */
+int main( int argc, char** argv )
+{
+    CommandLine const options( argc, argv, { "sizes", "samples", "repeats", "seed", "threads", "masses-per-edge", "polytomies" }, { "check" } );
+    if( not options.positionals().empty() ) {
+        throw std::runtime_error(
+            std::string( "Usage: " ) + argv[0] + " [--sizes 1000,10000,...] [--samples N] [--repeats N]"
+            " [--masses-per-edge N] [--polytomies F] [--seed S] [--threads N]\n"
+            "Use --check to compare the specialized kernels against BWPD() on small random trees instead.\n"
+        );
+    }
+
+    if( options.has( "check" ) ) {
+        std::mt19937_64 rng( options.get_size_t( "seed", 42 ));
+        size_t clades = 0;
+        auto const worst = check_clade_profile( 200, rng, clades );
+        std::cout << "clade_profile: " << clades << " clades, largest relative difference " << worst << "\n";
+        if( worst > 1e-9 ) {
+            throw std::runtime_error( "clade_profile() does not match BWPD() per clade." );
+        }
+        return 0;
+    }
+
+    auto sizes = options.get_size_t_list( "sizes" );
+    if( sizes.empty() ) {
+        sizes = { 1000, 10000, 100000, 1000000 };
+    }
+    auto const samples         = std::max< size_t >( 1, options.get_size_t( "samples", 8 ));
+    auto const repeats         = std::max< size_t >( 1, options.get_size_t( "repeats", 3 ));
+    auto const masses_per_edge = std::max< size_t >( 1, options.get_size_t( "masses-per-edge", 4 ));
+    auto const polytomies      = options.get_double( "polytomies", 0.0 );
+    auto const seed            = options.get_size_t( "seed", 42 );
+    auto const threads         = options.get_size_t( "threads", 1 );
+    set_num_threads( threads );
+
+    std::vector< double > const occupied_fractions = { 0.001, 0.01, 0.1, 1.0 };
+    auto const metrics = default_metric_set({ 0.0, 0.25, 0.5, 0.75, 1.0 });
+
+    std::mt19937_64 rng( seed );
+    JsonResults results;
+    std::vector< double > sink( samples );
+
+    for( auto const size : sizes ) {
+        auto const leaves = std::max< size_t >( 3, ( size + 3 ) / 2 );
+        auto const tree   = CommonTreeNewickReader().read( from_string( random_newick( leaves, polytomies, rng )));
+        auto const flat_tree = make_flat_tree< CommonEdgeData >( tree );
+        SparseTree const sparse_tree( flat_tree );
+        auto const edges = flat_tree.size();
+
+        for( auto const fraction : occupied_fractions ) {
+            auto const occupied = std::max< size_t >( 1, static_cast< size_t >( fraction * edges ));
+
+            std::vector< SparseMasses > sparse( samples );
+            std::vector< std::vector< double >> dense( samples );
+            for( size_t s = 0; s < samples; ++s ) {
+                sparse[ s ] = random_masses( edges, occupied, rng );
+                dense[ s ]  = to_dense( sparse[ s ], edges );
+            }
+
+            // full postorder scan, as for the mass tree of a jplace sample
+            auto const bwpd_dense = measure( repeats, [&](){
+                parallel_for( samples, [&]( size_t const s ) {
+                    MetricAccumulator accumulator( metrics );
+                    BWPD( flat_tree, dense[ s ], 1.0, accumulator );
+                    sink[ s ] = accumulator.row()[0];
+                });
+            });
+            results.add( "bwpd_dense", edges, fraction, samples, bwpd_dense, checksum( sink ));
+
+            // spanning subtree only, as for the best hit counts of a jplace sample
+            auto const bwpd_sparse = measure( repeats, [&](){
+                parallel_for( samples, [&]( size_t const s ) {
+                    MetricAccumulator accumulator( metrics );
+                    BWPD( sparse_tree, sparse[ s ], 1.0, accumulator );
+                    sink[ s ] = accumulator.row()[0];
+                });
+            });
+            results.add( "bwpd_sparse", edges, fraction, samples, bwpd_sparse, checksum( sink ));
+
+            // scrapp trees: several masses along each occupied edge, resolved by distal_edge_sum()
+            auto mass_tree = convert_common_tree_to_mass_tree( tree );
+            std::uniform_real_distribution< double > offset( 0.0, 1.0 );
+            for( size_t i = 0; i < sparse[0].size(); ++i ) {
+                auto& edge_data = mass_tree.edge_at( flat_tree.edge_index[ sparse[0].positions[ i ]] )
+                                           .data< MassTreeEdgeData >();
+                for( size_t m = 0; m < masses_per_edge; ++m ) {
+                    auto const position = ( 1.0 - offset( rng )) * edge_data.branch_length;
+                    edge_data.masses[ position ] += sparse[0].masses[ i ] / masses_per_edge;
+                }
+            }
+            mass_tree_normalize_masses( mass_tree );
+
+            // the original pointer-based kernel, and the same on a FlatTree built per call
+            auto const mass_tree_bwpd = measure( repeats, [&](){
+                parallel_for( samples, [&]( size_t const s ) {
+                    MetricAccumulator accumulator( metrics );
+                    PointerMassTreeBWPD( mass_tree, accumulator );
+                    sink[ s ] = accumulator.row()[0];
+                });
+            });
+            results.add( "mass_tree_bwpd", edges, fraction, samples, mass_tree_bwpd, checksum( sink ));
+
+            auto const mass_tree_flat_bwpd = measure( repeats, [&](){
+                parallel_for( samples, [&]( size_t const s ) {
+                    MetricAccumulator accumulator( metrics );
+                    MassTreeBWPD( mass_tree, accumulator );
+                    sink[ s ] = accumulator.row()[0];
+                });
+            });
+            results.add( "mass_tree_flat_bwpd", edges, fraction, samples, mass_tree_flat_bwpd, checksum( sink ));
+
+            // the same masses in the flat representation, including building them per sample
+            std::vector< FlatMassBuilder > builders( samples );
+            std::vector< FlatMasses > flat_masses( samples );
+            auto const flat_mass_bwpd = measure( repeats, [&](){
+                parallel_for( samples, [&]( size_t const s ) {
+                    builders[ s ].reset( edges );
+                    for( size_t i = 0; i < sparse[0].size(); ++i ) {
+                        auto const pos = sparse[0].positions[ i ];
+                        auto const& edge_data = mass_tree.edge_at( flat_tree.edge_index[ pos ] )
+                                                         .data< MassTreeEdgeData >();
+                        for( auto const& mass : edge_data.masses ) {
+                            builders[ s ].add( pos, mass.first, mass.second );
+                        }
+                    }
+                    builders[ s ].build( flat_masses[ s ], true );
+
+                    MetricAccumulator accumulator( metrics );
+                    FlatMassBWPD( flat_tree, flat_masses[ s ], accumulator );
+                    sink[ s ] = accumulator.row()[0];
+                });
+            });
+            results.add( "flat_mass_bwpd", edges, fraction, samples, flat_mass_bwpd, checksum( sink ));
+        }
+    }
+
+    results.write( std::cout, threads, seed, polytomies );
+    return 0;
+}
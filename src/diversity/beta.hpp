@@ -0,0 +1,188 @@
+#ifndef DIVERSITY_BETA_H_
+#define DIVERSITY_BETA_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "flat_tree.hpp"
+#include "parallel.hpp"
+#include "sparse.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Distal Mass Matrix
+// =================================================================================================
+
+/**
+ * Fraction of the mass of a sample that is on the distal side of each position, including the
+ * mass on the edge itself. This is the same postorder accumulation as in BWPD(), except that the
+ * placements of an edge count as being at its distal end.
+ */
+inline void distal_fractions(
+    FlatTree const& tree,
+    SparseMasses const& sparse,
+    double const total,
+    std::vector< double >& result
+) {
+    result.assign( tree.size(), 0.0 );
+    for( size_t i = 0; i < sparse.size(); ++i ) {
+        result[ sparse.positions[ i ]] += sparse.masses[ i ];
+    }
+    for( size_t pos = 0; pos < tree.size(); ++pos ) {
+        for( auto const child : tree.children_of( pos ) ) {
+            result[ pos ] += result[ child ];
+        }
+    }
+    for( auto& value : result ) {
+        value /= total;
+    }
+}
+
+/**
+ * The distal fractions are relative to the total of a sample, so that the distance to an empty
+ * sample is not defined. Throws for the first sample whose total is not positive.
+ */
+inline void check_beta_totals(
+    std::vector< std::string > const& names,
+    std::vector< double > const& totals
+) {
+    assert( names.size() == totals.size() );
+    for( size_t s = 0; s < totals.size(); ++s ) {
+        if( not std::isfinite( totals[ s ] ) or totals[ s ] <= 0.0 ) {
+            throw std::runtime_error(
+                "Sample " + names[ s ] + " has no queries, its beta diversity is not defined."
+            );
+        }
+    }
+}
+
+// =================================================================================================
+//     Pairwise Distances
+// =================================================================================================
+
+/**
+ * All-pairs weighted UniFrac distances between samples, which is the Kantorovich-Rubinstein (KR)
+ * distance with p = 1 when the placements of an edge are put at its distal end:
+ * `d(a,b) = sum_i l(i) * | D_a(i) - D_b(i) |`, with D(i) as in distal_fractions().
+ *
+ * We first build an edges x samples matrix of the distal fractions, keeping only the edges whose
+ * fraction is not the same in all samples, as the others do not contribute to any distance.
+ * The pairs are then processed in tiles of @p block x @p block samples, so that the accumulators
+ * of a tile stay in cache, and the innermost loop runs over the contiguous sample dimension of a
+ * matrix row, which the compiler vectorizes. Tiles are distributed over the threads.
+ *
+ * The result is the symmetric `S x S` distance matrix, stored row-major. All @p totals have to be
+ * positive, see check_beta_totals().
+ */
+inline std::vector< double > pairwise_distances(
+    FlatTree const& tree,
+    std::vector< SparseMasses > const& samples,
+    std::vector< double > const& totals,
+    size_t const block = 64
+) {
+    assert( samples.size() == totals.size() );
+    auto const n = tree.size();
+    auto const S = samples.size();
+
+    // first pass: which edges differ between the samples
+    std::vector< double > lowest( n, std::numeric_limits< double >::max() );
+    std::vector< double > highest( n, std::numeric_limits< double >::lowest() );
+    std::vector< double > fractions;
+    for( size_t s = 0; s < S; ++s ) {
+        distal_fractions( tree, samples[ s ], totals[ s ], fractions );
+        for( size_t pos = 0; pos < n; ++pos ) {
+            lowest[ pos ]  = std::min( lowest[ pos ],  fractions[ pos ] );
+            highest[ pos ] = std::max( highest[ pos ], fractions[ pos ] );
+        }
+    }
+    std::vector< size_t > active;
+    std::vector< double > weights;
+    for( size_t pos = 0; pos < n; ++pos ) {
+        if( lowest[ pos ] != highest[ pos ] and tree.branch_length[ pos ] != 0.0 ) {
+            active.push_back( pos );
+            weights.push_back( tree.branch_length[ pos ] );
+        }
+    }
+
+    // second pass: the edges x samples matrix, one column per sample
+    std::vector< double > matrix( active.size() * S );
+    parallel_for( S, [&]( size_t const s ) {
+        std::vector< double > sample_fractions;
+        distal_fractions( tree, samples[ s ], totals[ s ], sample_fractions );
+        for( size_t e = 0; e < active.size(); ++e ) {
+            matrix[ e * S + s ] = sample_fractions[ active[ e ]];
+        }
+    });
+
+    // tiles of the upper triangle, including the diagonal
+    std::vector< std::pair< size_t, size_t >> tiles;
+    for( size_t a = 0; a < S; a += block ) {
+        for( size_t b = a; b < S; b += block ) {
+            tiles.emplace_back( a, b );
+        }
+    }
+
+    std::vector< double > result( S * S, 0.0 );
+    parallel_for( tiles.size(), [&]( size_t const t ) {
+        auto const a_begin = tiles[ t ].first;
+        auto const b_begin = tiles[ t ].second;
+        auto const a_size  = std::min( block, S - a_begin );
+        auto const b_size  = std::min( block, S - b_begin );
+
+        std::vector< double > acc( a_size * b_size, 0.0 );
+        for( size_t e = 0; e < active.size(); ++e ) {
+            auto const* row_a = &matrix[ e * S + a_begin ];
+            auto const* row_b = &matrix[ e * S + b_begin ];
+            auto const weight = weights[ e ];
+
+            for( size_t a = 0; a < a_size; ++a ) {
+                auto const x = row_a[ a ];
+                auto* acc_a  = &acc[ a * b_size ];
+
+                #pragma omp simd
+                for( size_t b = 0; b < b_size; ++b ) {
+                    acc_a[ b ] += weight * std::abs( x - row_b[ b ] );
+                }
+            }
+        }
+
+        for( size_t a = 0; a < a_size; ++a ) {
+            for( size_t b = 0; b < b_size; ++b ) {
+                auto const i = a_begin + a;
+                auto const j = b_begin + b;
+                result[ i * S + j ] = acc[ a * b_size + b ];
+                result[ j * S + i ] = acc[ a * b_size + b ];
+            }
+        }
+    });
+
+    return result;
+}
+
+#endif // include guard
@@ -0,0 +1,113 @@
+#ifndef DIVERSITY_BWPD_H_
+#define DIVERSITY_BWPD_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "flat_tree.hpp"
+#include "functions.hpp"
+
+#include <vector>
+
+// =================================================================================================
+//     BWPD over a Flat Tree
+// =================================================================================================
+
+/**
+ * Default for the @p distal_sum parameter of BWPD(): edges do not carry any further structure
+ * besides their total mass.
+ */
+struct NoDistalSum
+{
+    template< class accumulator_t >
+    void operator()( size_t, accumulator_t& ) const
+    {}
+};
+
+/**
+ * https://dx.doi.org/10.7717%2Fpeerj.157
+ *
+ * The goal is to iterate over all edges and calculate D_s(i), which is the fraction of reads in
+ * sample s that are in leaves (or edges / placements in our case) on the distal side of edge i.
+ * Then, the BWPD is the sum of edge length l(i) multiplied by [2min(D(i),1−D(i))]^θ. For θ=0, and
+ * evaluating only those edges that are in a samples spanning tree, this results in the somewhat
+ * classical FaithPD, except adapted to phylogenetic placement.
+ *
+ * We calculate D(i) bottom-up in one linear scan over the postorder positions of the FlatTree,
+ * dragging with us the distal-side masses of the children, and dividing them by the total mass.
+ * Every (branch length, D(i)) pair of an inner edge is handed to the accumulator.
+ *
+ * @param  tree         postorder topology of the reference tree
+ * @param  masses       mass (or query count) per FlatTree position
+ * @param  total        total mass of the sample, used to turn distal masses into fractions
+ * @param  accumulator  receives the (branch length, D(i)) pairs, see MetricAccumulator
+ * @param  distal_sum   called as `distal_sum( child_pos, accumulator )` for each child of an inner
+ *                      edge that has no mass on its distal side, before the edge itself is added.
+ */
+template< class accumulator_t, class distal_sum_t >
+void BWPD(
+    FlatTree const& tree,
+    std::vector< double > const& masses,
+    double const total,
+    accumulator_t& accumulator,
+    distal_sum_t distal_sum
+) {
+    assert( masses.size() == tree.size() );
+
+    // distal mass of each position, not including the mass on the edge itself
+    std::vector< double > distal( tree.size() );
+
+    for( size_t pos = 0; pos < tree.size(); ++pos ) {
+
+        // if this is a leaf, there cannot be any mass on the distal side, so we skip
+        if( tree.is_leaf( pos ) ) {
+            distal[ pos ] = 0.0;
+            continue;
+        }
+
+        // interior edges:
+        // calculate the new distal mass as the sum of distal masses and masses of the child edges
+        distal[ pos ] = 0.0;
+        for( auto const child : tree.children_of( pos ) ) {
+            distal[ pos ] += distal[ child ] + masses[ child ];
+
+            if( equals_approx( distal[ child ] / total, 0.0 ) ) {
+                distal_sum( child, accumulator );
+            }
+        }
+
+        // update the metric sums with D(i) of this edge
+        accumulator.add( tree.branch_length[ pos ], distal[ pos ] / total );
+    }
+}
+
+template< class accumulator_t >
+void BWPD(
+    FlatTree const& tree,
+    std::vector< double > const& masses,
+    double const total,
+    accumulator_t& accumulator
+) {
+    BWPD( tree, masses, total, accumulator, NoDistalSum() );
+}
+
+#endif // include guard
@@ -0,0 +1,556 @@
+#ifndef DIVERSITY_CACHE_H_
+#define DIVERSITY_CACHE_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "flat_masses.hpp"
+#include "flat_tree.hpp"
+#include "sparse.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+// =================================================================================================
+//     Cache Format
+// =================================================================================================
+
+/*
+    Binary cache of a parsed data set: the FlatTree of the reference tree once, and per sample its
+    best hit counts and its placement masses, as sparse lists over the positions.
+
+    All sections start at multiples of 8 bytes, so that the arrays can be used in place when the
+    file is memory mapped. Numbers are stored in native byte order, as the cache only serves the
+    machine that wrote it. The header records `cache_byte_order` in that order, so that a file from
+    a machine with a different byte order is rejected, and rebuilt, instead of misread.
+
+    The size and modification time of each input file (and of the chunked jplace file, if any) are
+    kept as well, so that a cache whose inputs have changed since is noticed, see file_stamp().
+
+        CacheHeader
+        tree:    child_offset[n+1], children[child_offset[n]] (uint64), branch_length[n] (double)
+        index:   CacheSampleIndex[sample_count]
+        samples: per sample
+                 count positions (uint64), counts (double)
+                 mass positions (uint64), points (double), masses (double)
+                 name (chars, padded to 8 bytes)
+*/
+
+/**
+ * Size and modification time (in seconds) of an input file of the cache.
+ */
+struct FileStamp
+{
+    uint64_t size  = 0;
+    int64_t  mtime = 0;
+
+    bool operator==( FileStamp const& other ) const
+    {
+        return size == other.size and mtime == other.mtime;
+    }
+
+    bool operator!=( FileStamp const& other ) const
+    {
+        return not( *this == other );
+    }
+};
+
+/**
+ * The FileStamp of @p file, or an empty one if it can not be read.
+ */
+inline FileStamp file_stamp( std::string const& file )
+{
+    FileStamp result;
+#if defined( __unix__ ) || defined( __APPLE__ )
+    struct stat info;
+    if( ::stat( file.c_str(), &info ) == 0 ) {
+        result.size  = static_cast< uint64_t >( info.st_size );
+        result.mtime = static_cast< int64_t >( info.st_mtime );
+    }
+#else
+    std::ifstream in( file, std::ios::binary | std::ios::ate );
+    if( in ) {
+        result.size = static_cast< uint64_t >( in.tellg() );
+    }
+#endif
+    return result;
+}
+
+struct CacheHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t edge_count;
+    uint64_t sample_count;
+    uint64_t tree_offset;
+    uint64_t index_offset;
+    uint64_t file_size;
+
+    // the chunked jplace file of the samples, or empty
+    FileStamp chunked_input;
+};
+
+struct CacheSampleIndex
+{
+    uint64_t name_offset;
+    uint64_t name_length;
+
+    uint64_t count_offset;
+    uint64_t count_size;
+    double   total_count;
+
+    uint64_t mass_offset;
+    uint64_t mass_size;
+    double   total_mass;
+
+    FileStamp input;
+};
+
+static char const cache_magic[8] = { 'B', 'W', 'P', 'D', 'C', 'A', 'C', 'H' };
+static uint32_t const cache_version    = 3;
+static uint32_t const cache_byte_order = 0x01020304;
+
+// =================================================================================================
+//     Cache Writer
+// =================================================================================================
+
+/**
+ * Everything about one sample that goes into the cache.
+ *
+ * The point masses are not normalized, and are kept with their position along the edge, so that
+ * later metrics that need them do not require to re-parse the samples.
+ */
+struct CacheSample
+{
+    std::string name;
+    FileStamp input;
+
+    SparseMasses counts;
+    double total_count = 0.0;
+
+    FlatMasses masses;
+    double total_mass = 0.0;
+};
+
+inline void write_cache(
+    std::string const& file,
+    FlatTree const& tree,
+    std::vector< CacheSample > const& samples,
+    FileStamp const& chunked_input = FileStamp()
+) {
+    auto const n = tree.size();
+    auto const pad = []( uint64_t size ){
+        return ( size + 7 ) / 8 * 8;
+    };
+
+    // lay out the file
+    CacheHeader header;
+    std::memcpy( header.magic, cache_magic, sizeof( cache_magic ));
+    header.version      = cache_version;
+    header.byte_order   = cache_byte_order;
+    header.edge_count   = n;
+    header.sample_count = samples.size();
+    header.tree_offset  = pad( sizeof( CacheHeader ));
+    header.index_offset = header.tree_offset + 8 * ( tree.child_offset.size() + tree.children.size() + n );
+
+    std::vector< CacheSampleIndex > index( samples.size() );
+    uint64_t offset = header.index_offset + pad( sizeof( CacheSampleIndex ) * samples.size() );
+    for( size_t s = 0; s < samples.size(); ++s ) {
+        auto const& sample = samples[ s ];
+        index[ s ].count_offset = offset;
+        index[ s ].count_size   = sample.counts.size();
+        index[ s ].total_count  = sample.total_count;
+        offset += 2 * 8 * sample.counts.size();
+
+        index[ s ].mass_offset = offset;
+        index[ s ].mass_size   = sample.masses.points.size();
+        index[ s ].total_mass  = sample.total_mass;
+        offset += 3 * 8 * sample.masses.points.size();
+
+        index[ s ].name_offset = offset;
+        index[ s ].name_length = sample.name.size();
+        index[ s ].input       = sample.input;
+        offset += pad( sample.name.size() );
+    }
+    header.file_size = offset;
+    header.chunked_input = chunked_input;
+
+    std::ofstream out( file, std::ios::binary );
+    if( not out ) {
+        throw std::runtime_error( "Cannot write cache file " + file );
+    }
+    auto const write = [&]( void const* data, size_t const size ){
+        out.write( static_cast< char const* >( data ), static_cast< std::streamsize >( size ));
+    };
+    auto const write_padding = [&]( uint64_t const size ){
+        static char const zeros[8] = {};
+        write( zeros, pad( size ) - size );
+    };
+    auto const write_u64 = [&]( std::vector< size_t > const& values ){
+        for( auto const value : values ) {
+            auto const stored = static_cast< uint64_t >( value == FlatTree::npos ? UINT64_MAX : value );
+            write( &stored, 8 );
+        }
+    };
+    auto const write_f64 = [&]( std::vector< double > const& values ){
+        write( values.data(), 8 * values.size() );
+    };
+
+    write( &header, sizeof( CacheHeader ));
+    write_padding( sizeof( CacheHeader ));
+    write_u64( tree.child_offset );
+    write_u64( tree.children );
+    write_f64( tree.branch_length );
+    write( index.data(), sizeof( CacheSampleIndex ) * index.size() );
+    write_padding( sizeof( CacheSampleIndex ) * index.size() );
+
+    std::vector< size_t > mass_positions;
+    for( auto const& sample : samples ) {
+        write_u64( sample.counts.positions );
+        write_f64( sample.counts.masses );
+
+        mass_positions.clear();
+        for( size_t pos = 0; pos < sample.masses.size(); ++pos ) {
+            mass_positions.insert(
+                mass_positions.end(), sample.masses.offset[ pos + 1 ] - sample.masses.offset[ pos ], pos
+            );
+        }
+        write_u64( mass_positions );
+        write_f64( sample.masses.points );
+        write_f64( sample.masses.masses );
+
+        write( sample.name.data(), sample.name.size() );
+        write_padding( sample.name.size() );
+    }
+
+    if( not out ) {
+        throw std::runtime_error( "Cannot write cache file " + file );
+    }
+}
+
+// =================================================================================================
+//     Mapped File
+// =================================================================================================
+
+/**
+ * Read-only view of a whole file, memory mapped where possible, and read into memory otherwise.
+ */
+class MappedFile
+{
+public:
+
+    explicit MappedFile( std::string const& file )
+    {
+#if defined( __unix__ ) || defined( __APPLE__ )
+        auto const fd = ::open( file.c_str(), O_RDONLY );
+        if( fd < 0 ) {
+            throw std::runtime_error( "Cannot open cache file " + file );
+        }
+        struct stat info;
+        if( ::fstat( fd, &info ) != 0 ) {
+            ::close( fd );
+            throw std::runtime_error( "Cannot open cache file " + file );
+        }
+        size_ = static_cast< size_t >( info.st_size );
+        if( size_ > 0 ) {
+            auto const mapped = ::mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( mapped == MAP_FAILED ) {
+                ::close( fd );
+                throw std::runtime_error( "Cannot map cache file " + file );
+            }
+            data_ = static_cast< char const* >( mapped );
+        }
+        ::close( fd );
+#else
+        std::ifstream in( file, std::ios::binary | std::ios::ate );
+        if( not in ) {
+            throw std::runtime_error( "Cannot open cache file " + file );
+        }
+        size_ = static_cast< size_t >( in.tellg() );
+        buffer_.resize(( size_ + 7 ) / 8 );
+        in.seekg( 0 );
+        in.read( reinterpret_cast< char* >( buffer_.data() ), static_cast< std::streamsize >( size_ ));
+        data_ = reinterpret_cast< char const* >( buffer_.data() );
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if defined( __unix__ ) || defined( __APPLE__ )
+        if( data_ ) {
+            ::munmap( const_cast< char* >( data_ ), size_ );
+        }
+#endif
+    }
+
+    MappedFile( MappedFile const& ) = delete;
+    MappedFile& operator=( MappedFile const& ) = delete;
+
+    char const* data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+private:
+
+    char const* data_ = nullptr;
+    size_t size_ = 0;
+
+#if !( defined( __unix__ ) || defined( __APPLE__ ))
+    // uint64_t, so that the arrays are aligned
+    std::vector< uint64_t > buffer_;
+#endif
+};
+
+// =================================================================================================
+//     Cache Reader
+// =================================================================================================
+
+/**
+ * A cache file written by write_cache(), memory mapped. The arrays of the samples are used in
+ * place, without parsing or copying the file, see cached_counts() and cached_edge_masses().
+ * Only the FlatTree of the reference tree is copied once, see flat_tree().
+ *
+ * All offsets and sizes of the tree and of the samples are checked against the mapped file when
+ * opening it, so that a truncated or otherwise broken file is an error instead of a read outside
+ * of the mapping.
+ */
+class DiversityCache
+{
+public:
+
+    /**
+     * The arrays of one sample, pointing into the mapped file.
+     */
+    struct SampleView
+    {
+        size_t count_size;
+        uint64_t const* count_positions;
+        double const* counts;
+        double total_count;
+
+        size_t mass_size;
+        uint64_t const* mass_positions;
+        double const* mass_points;
+        double const* masses;
+        double total_mass;
+    };
+
+    explicit DiversityCache( std::string const& file )
+        : file_( file )
+    {
+        if( file_.size() < sizeof( CacheHeader )) {
+            throw std::runtime_error( "Invalid cache file " + file );
+        }
+        header_ = reinterpret_cast< CacheHeader const* >( file_.data() );
+        if( std::memcmp( header_->magic, cache_magic, sizeof( cache_magic )) != 0
+            or header_->byte_order != cache_byte_order
+            or header_->version != cache_version
+            or header_->file_size != file_.size()
+        ) {
+            throw std::runtime_error(
+                "Invalid cache file " + file + " (different version or machine, or incomplete). "
+                "Delete it to rebuild the cache."
+            );
+        }
+        validate_( file );
+    }
+
+    size_t sample_count() const
+    {
+        return header_->sample_count;
+    }
+
+    std::string sample_name( size_t const i ) const
+    {
+        return std::string( file_.data() + index_[ i ].name_offset, index_[ i ].name_length );
+    }
+
+    /**
+     * The FileStamp of the input file of sample @p i when the cache was written.
+     */
+    FileStamp sample_input( size_t const i ) const
+    {
+        return index_[ i ].input;
+    }
+
+    /**
+     * The FileStamp of the chunked jplace file when the cache was written, empty if there was none.
+     */
+    FileStamp chunked_input() const
+    {
+        return header_->chunked_input;
+    }
+
+    SampleView sample( size_t const i ) const
+    {
+        auto const& entry = index_[ i ];
+        auto const count_data = file_.data() + entry.count_offset;
+        auto const mass_data  = file_.data() + entry.mass_offset;
+
+        SampleView result;
+        result.count_size      = entry.count_size;
+        result.count_positions = reinterpret_cast< uint64_t const* >( count_data );
+        result.counts          = reinterpret_cast< double const* >( count_data + 8 * entry.count_size );
+        result.total_count     = entry.total_count;
+        result.mass_size       = entry.mass_size;
+        result.mass_positions  = reinterpret_cast< uint64_t const* >( mass_data );
+        result.mass_points     = reinterpret_cast< double const* >( mass_data + 8 * entry.mass_size );
+        result.masses          = reinterpret_cast< double const* >( mass_data + 16 * entry.mass_size );
+        result.total_mass      = entry.total_mass;
+        return result;
+    }
+
+    /**
+     * The FlatTree of the reference tree. Edge indices are the positions, as the genesis tree is
+     * not part of the cache.
+     */
+    FlatTree flat_tree() const
+    {
+        auto const n = header_->edge_count;
+        auto const offsets  = reinterpret_cast< uint64_t const* >( file_.data() + header_->tree_offset );
+        auto const children = offsets + n + 1;
+        auto const bl       = reinterpret_cast< double const* >( children + offsets[ n ] );
+
+        FlatTree result;
+        result.edge_index.resize( n );
+        std::iota( result.edge_index.begin(), result.edge_index.end(), 0 );
+        result.position = result.edge_index;
+        result.child_offset.assign( offsets, offsets + n + 1 );
+        result.children.assign( children, children + offsets[ n ] );
+        result.branch_length.assign( bl, bl + n );
+        return result;
+    }
+
+private:
+
+    /**
+     * Whether @p count elements of @p width bytes starting at @p offset are inside of the file,
+     * and aligned, without overflowing.
+     */
+    bool in_file_( uint64_t const offset, uint64_t const count, uint64_t const width ) const
+    {
+        auto const size = static_cast< uint64_t >( file_.size() );
+        return offset % 8 == 0 and offset <= size and count <= ( size - offset ) / width;
+    }
+
+    void validate_( std::string const& file )
+    {
+        auto const invalid = [&](){
+            return std::runtime_error( "Invalid cache file " + file + ". Delete it to rebuild the cache." );
+        };
+
+        // the tree: offsets, children and branch lengths, with children pointing below each edge
+        auto const n = header_->edge_count;
+        if( n == UINT64_MAX or not in_file_( header_->tree_offset, n + 1, 8 )) {
+            throw invalid();
+        }
+        auto const offsets = reinterpret_cast< uint64_t const* >( file_.data() + header_->tree_offset );
+        auto const children_offset = header_->tree_offset + 8 * ( n + 1 );
+        if( offsets[0] != 0 or not in_file_( children_offset, offsets[ n ], 8 )
+            or not in_file_( children_offset + 8 * offsets[ n ], n, 8 )
+        ) {
+            throw invalid();
+        }
+        auto const children = offsets + n + 1;
+        for( size_t pos = 0; pos < n; ++pos ) {
+            if( offsets[ pos ] > offsets[ pos + 1 ] ) {
+                throw invalid();
+            }
+            for( auto c = offsets[ pos ]; c < offsets[ pos + 1 ]; ++c ) {
+                if( children[ c ] >= pos ) {
+                    throw invalid();
+                }
+            }
+        }
+
+        // the index, and the arrays of each sample
+        if( not in_file_( header_->index_offset, header_->sample_count, sizeof( CacheSampleIndex ))) {
+            throw invalid();
+        }
+        index_ = reinterpret_cast< CacheSampleIndex const* >( file_.data() + header_->index_offset );
+        for( size_t i = 0; i < header_->sample_count; ++i ) {
+            auto const& entry = index_[ i ];
+            if( not in_file_( entry.count_offset, entry.count_size, 16 )
+                or not in_file_( entry.mass_offset, entry.mass_size, 24 )
+                or not in_file_( entry.name_offset, entry.name_length, 1 )
+            ) {
+                throw invalid();
+            }
+
+            // the kernels index the tree with the positions, and expect them sorted
+            auto const count_positions = reinterpret_cast< uint64_t const* >( file_.data() + entry.count_offset );
+            auto const mass_positions  = reinterpret_cast< uint64_t const* >( file_.data() + entry.mass_offset );
+            for( size_t j = 0; j < entry.count_size; ++j ) {
+                if( count_positions[ j ] >= n or ( j > 0 and count_positions[ j ] < count_positions[ j - 1 ] )) {
+                    throw invalid();
+                }
+            }
+            for( size_t j = 0; j < entry.mass_size; ++j ) {
+                if( mass_positions[ j ] >= n or ( j > 0 and mass_positions[ j ] < mass_positions[ j - 1 ] )) {
+                    throw invalid();
+                }
+            }
+        }
+    }
+
+    MappedFile file_;
+    CacheHeader const* header_ = nullptr;
+    CacheSampleIndex const* index_ = nullptr;
+};
+
+/**
+ * The sparse counts of a cached sample, in place in the mapped file.
+ */
+inline SparseView< uint64_t > cached_counts( DiversityCache::SampleView const& sample )
+{
+    return { sample.count_size, sample.count_positions, sample.counts };
+}
+
+/**
+ * The masses of a cached sample, in place in the mapped file. The points of an edge are repeated
+ * positions, whose masses the sparse BWPD() sums up.
+ */
+inline SparseView< uint64_t > cached_edge_masses( DiversityCache::SampleView const& sample )
+{
+    return { sample.mass_size, sample.mass_positions, sample.masses };
+}
+
+#endif // include guard
@@ -0,0 +1,271 @@
+#ifndef DIVERSITY_CHUNKED_H_
+#define DIVERSITY_CHUNKED_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "genesis/genesis.hpp"
+
+#include "flat_masses.hpp"
+#include "flat_tree.hpp"
+#include "placement_filter.hpp"
+#include "sparse.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// =================================================================================================
+//     Chunked Placements
+// =================================================================================================
+
+/**
+ * The placements of a chunked EPA result (one pquery per unique sequence, named by its hash, see
+ * `gappa prepare chunkify`), flattened so that they can be fanned out to many samples.
+ *
+ * For each pquery, we keep the FlatTree position of its best hit, and the positions and
+ * (normalized) like weight ratios of all of its placements, in one contiguous array.
+ * The Sample itself is not needed any more afterwards.
+ */
+struct ChunkedPlacements
+{
+    FlatTree flat_tree;
+
+    std::unordered_map< std::string, size_t > pquery_index;
+
+    std::vector< size_t > best_position;
+
+    /**
+     * Placements of pquery `i` are in `[ placement_offset[i], placement_offset[i+1] )`.
+     */
+    std::vector< size_t > placement_offset;
+    std::vector< size_t > placement_position;
+    std::vector< double > placement_proximal;
+    std::vector< double > placement_lwr;
+};
+
+inline ChunkedPlacements make_chunked_placements( genesis::placement::Sample& chunk )
+{
+    using namespace genesis::placement;
+
+    normalize_weight_ratios( chunk );
+
+    ChunkedPlacements result;
+    result.flat_tree = make_flat_tree< PlacementEdgeData >( chunk.tree() );
+    result.placement_offset.push_back( 0 );
+
+    for( auto const& pquery : chunk.pqueries() ) {
+        auto const index = result.best_position.size();
+        for( auto const& name : pquery.names() ) {
+            result.pquery_index[ name.name ] = index;
+        }
+
+        size_t best = 0;
+        for( size_t p = 0; p < pquery.placement_size(); ++p ) {
+            auto const& placement = pquery.placement_at( p );
+            if( placement.like_weight_ratio > pquery.placement_at( best ).like_weight_ratio ) {
+                best = p;
+            }
+            result.placement_position.push_back( result.flat_tree.position[ placement.edge().index() ] );
+            result.placement_proximal.push_back( placement.proximal_length );
+            result.placement_lwr.push_back( placement.like_weight_ratio );
+        }
+        result.best_position.push_back(
+            pquery.placement_size() == 0
+            ? static_cast< size_t >( FlatTree::npos )
+            : result.flat_tree.position[ pquery.placement_at( best ).edge().index() ]
+        );
+        result.placement_offset.push_back( result.placement_position.size() );
+    }
+    return result;
+}
+
+// =================================================================================================
+//     Abundance Maps
+// =================================================================================================
+
+struct AbundanceEntry
+{
+    std::string name;
+    double abundance;
+};
+
+/**
+ * Name of the sample of an abundance map file: the file name without directory and extension,
+ * and without the `abundances_` prefix that chunkify uses.
+ */
+inline std::string abundance_map_sample_name( std::string const& map_file )
+{
+    auto name = genesis::utils::file_filename( genesis::utils::file_basename( map_file ));
+    std::string const prefix = "abundances_";
+    if( name.compare( 0, prefix.size(), prefix ) == 0 ) {
+        name = name.substr( prefix.size() );
+    }
+    return name;
+}
+
+/**
+ * Read an abundance map file as written by `gappa prepare chunkify`.
+ *
+ * Each line holds the hash of a sequence and its abundance in the sample, separated by
+ * whitespace. If a line has more than two fields, the hash is the second to last field and the
+ * abundance the last one.
+ */
+inline std::vector< AbundanceEntry > read_abundance_map( std::string const& map_file )
+{
+    std::ifstream in( map_file );
+    if( not in ) {
+        throw std::runtime_error( "Cannot read abundance map " + map_file );
+    }
+
+    std::vector< AbundanceEntry > result;
+    std::string line;
+    std::vector< std::string > fields;
+    while( std::getline( in, line )) {
+        std::istringstream line_stream( line );
+        fields.clear();
+        std::string field;
+        while( line_stream >> field ) {
+            fields.push_back( field );
+        }
+        if( fields.empty() ) {
+            continue;
+        }
+        if( fields.size() == 1 ) {
+            result.push_back({ fields[0], 1.0 });
+            continue;
+        }
+
+        char* end = nullptr;
+        auto const abundance = std::strtod( fields.back().c_str(), &end );
+        if( *end != '\0' ) {
+            throw std::runtime_error( "Invalid abundance in " + map_file + ": " + line );
+        }
+        result.push_back({ fields[ fields.size() - 2 ], abundance });
+    }
+    return result;
+}
+
+// =================================================================================================
+//     Per-Sample Masses
+// =================================================================================================
+
+/**
+ * Masses of one sample of the chunked result, both for the best hit counts and for the masses of
+ * all placements. Samples typically only touch a small part of the tree, so these are sparse.
+ */
+struct ChunkedSampleMasses
+{
+    SparseMasses counts;
+    double total_count = 0.0;
+
+    SparseMasses masses;
+    double total_mass = 0.0;
+};
+
+/**
+ * Fan the placements out to the masses of one sample, given its abundance map.
+ *
+ * This yields the same masses as unchunkifying the sample to its own jplace file and reading
+ * that: each map entry becomes one pquery with the abundance as its multiplicity. The best hit
+ * counts count the names of the pqueries, the placement masses are weighted by the multiplicity.
+ * Sequences that are not in the chunked result are skipped, as unchunkify does.
+ *
+ * The counts are spread over the placements of each pquery according to the @p filter.
+ */
+inline ChunkedSampleMasses chunked_sample_masses(
+    ChunkedPlacements const& chunked,
+    std::vector< AbundanceEntry > const& abundances,
+    PlacementFilter const& filter = PlacementFilter()
+) {
+    ChunkedSampleMasses result;
+    static thread_local WeightedCounts weighted;
+    if( not filter.best_hit_only() ) {
+        weighted.reset( chunked.flat_tree.size() );
+    }
+
+    for( auto const& entry : abundances ) {
+        auto const it = chunked.pquery_index.find( entry.name );
+        if( it == chunked.pquery_index.end() ) {
+            continue;
+        }
+        auto const index = it->second;
+
+        auto const begin = chunked.placement_offset[ index ];
+        auto const end   = chunked.placement_offset[ index + 1 ];
+
+        result.total_count += 1.0;
+        if( not filter.best_hit_only() ) {
+            weighted.add(
+                &chunked.placement_position[0] + begin, &chunked.placement_lwr[0] + begin, end - begin, 1.0, filter
+            );
+        } else if( chunked.best_position[ index ] != FlatTree::npos ) {
+            result.counts.add( chunked.best_position[ index ], 1.0 );
+        }
+
+        for( size_t p = begin; p < end; ++p ) {
+            auto const mass = chunked.placement_lwr[ p ] * entry.abundance;
+            result.masses.add( chunked.placement_position[ p ], mass );
+            result.total_mass += mass;
+        }
+    }
+    if( filter.best_hit_only() ) {
+        normalize_sparse_masses( result.counts );
+    } else {
+        result.counts = weighted.result();
+    }
+    normalize_sparse_masses( result.masses );
+    return result;
+}
+
+/**
+ * The point masses of one sample along the edges, as chunked_sample_masses() computes their sums
+ * per edge, written to @p result. The masses are not normalized.
+ */
+inline void chunked_sample_point_masses(
+    ChunkedPlacements const& chunked,
+    std::vector< AbundanceEntry > const& abundances,
+    FlatMassBuilder& builder,
+    FlatMasses& result
+) {
+    builder.reset( chunked.flat_tree.size() );
+    for( auto const& entry : abundances ) {
+        auto const it = chunked.pquery_index.find( entry.name );
+        if( it == chunked.pquery_index.end() ) {
+            continue;
+        }
+        auto const index = it->second;
+        for( size_t p = chunked.placement_offset[ index ]; p < chunked.placement_offset[ index + 1 ]; ++p ) {
+            builder.add(
+                chunked.placement_position[ p ], chunked.placement_proximal[ p ],
+                chunked.placement_lwr[ p ] * entry.abundance
+            );
+        }
+    }
+    builder.build( result, false );
+}
+
+#endif // include guard
@@ -0,0 +1,270 @@
+#ifndef DIVERSITY_CLADE_PROFILE_H_
+#define DIVERSITY_CLADE_PROFILE_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "flat_tree.hpp"
+#include "functions.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+// =================================================================================================
+//     Clade Profile
+// =================================================================================================
+
+/**
+ * Metrics of every clade of the reference tree, that is, of the subtree below each inner edge,
+ * with the masses renormalized to the mass of that clade.
+ *
+ * Rows are only kept for clades that hold some mass, in postorder. Each row is laid out as in
+ * MetricAccumulator::write_row().
+ */
+struct CladeProfile
+{
+    std::vector< size_t > positions;
+    std::vector< double > clade_mass;
+    std::vector< double > rows;
+
+    size_t size() const
+    {
+        return positions.size();
+    }
+
+    double const* row( size_t const i, MetricSet const& metrics ) const
+    {
+        return rows.data() + i * metrics.row_size();
+    }
+};
+
+/**
+ * Compute the CladeProfile of a sample in one postorder scan, see BWPD() for the parameters.
+ * The scan is not linear in the worst case, see below.
+ *
+ * Within the clade of position p with mass M, an edge with distal mass d has `D(i) = d / M`.
+ * Both entropies are then linear in per-edge terms that do not depend on M:
+ * `sum l x log x = ( sum l d log d - log M sum l d ) / M` and
+ * `sum l x (1 - x) = sum l d / M - sum l d^2 / M^2`. We accumulate these sums over the subtrees,
+ * the same way as the distal masses themselves.
+ *
+ * For BWPD, `(2 min(x, 1 - x))^theta = (2 / M)^theta * min(d, M - d)^theta`, so we accumulate
+ * `sum l d^theta` per theta. Only edges with `d > M / 2` need `M - d` instead, and those form a
+ * path down from p along the heavy children (the child with the largest distal mass), as at most
+ * one child of any node can hold more than half of the mass. The heavy children link the edges
+ * into disjoint heavy paths, along which we keep suffix sums of `l d^theta`, so that the
+ * `d^theta` terms of the path are removed in constant time per theta. The lower end of the path
+ * only moves up a heavy path as the clades get larger, and so does the end of its leading edges
+ * that hold all of the mass (`M - d = 0`), so that both are found in amortized constant time.
+ *
+ * What remains are the `l (M - d)^theta` terms of the edges with mass on both of their sides
+ * within the clade. They depend on M, and can not be summed up ahead for non-integral thetas, so
+ * these edges are visited once per clade whose heavy path they are on. The scan thus takes
+ * `O( thetas * ( n + m ))` for `n` edges and `m` such visits in total. This is linear as long as
+ * the clades split their mass evenly, but quadratic in the worst case: in a caterpillar with mass
+ * on every leaf, the clade of the k-th inner edge visits about k / 2 edges, so that `m ~ n^2 / 16`.
+ *
+ * Faith's PD is BWPD with theta 0. Hill numbers are not linear in such per-edge sums, and are not
+ * supported here.
+ */
+inline void clade_profile(
+    FlatTree const& tree,
+    std::vector< double > const& masses,
+    MetricSet const& metrics,
+    CladeProfile& result
+) {
+    assert( masses.size() == tree.size() );
+    auto const n = tree.size();
+
+    // all thetas, the grid ones after those of the metrics, and where each metric finds its value
+    // in the values of a clade: both entropies, followed by BWPD per theta
+    std::vector< double > thetas;
+    std::vector< size_t > value_index;
+    for( auto const& spec : metrics.specs ) {
+        switch( spec.kind ) {
+            case MetricSpec::entropy:
+                value_index.push_back( 0 );
+                break;
+            case MetricSpec::quadratic:
+                value_index.push_back( 1 );
+                break;
+            case MetricSpec::bwpd:
+            case MetricSpec::faith:
+                value_index.push_back( 2 + thetas.size() );
+                thetas.push_back( spec.kind == MetricSpec::faith ? 0.0 : spec.parameter );
+                break;
+            case MetricSpec::hill:
+                throw std::runtime_error( "Hill numbers are not supported for clade profiles." );
+        }
+    }
+    auto const fixed  = thetas.size();
+    for( size_t i = 0; i < metrics.grid.steps; ++i ) {
+        value_index.push_back( 2 + thetas.size() );
+        thetas.push_back( metrics.grid.theta( i ));
+    }
+    auto const width  = 3 + thetas.size();
+    std::vector< double > values( 2 + thetas.size() );
+
+    // per position, the sums of l d, l d log d, l d^2 and l d^theta over the edges of its clade
+    std::vector< double > sums( n * width, 0.0 );
+    std::vector< double > distal( n, 0.0 );
+
+    // heavy paths: the heavy child of each position, and the position it is the heavy child of.
+    // per position, the suffix sums of l d^theta along its heavy path, and the lowest edges of
+    // that path below it with more than half of (cut), and all of (full) the mass of its clade.
+    std::vector< size_t > heavy( n, FlatTree::npos );
+    std::vector< size_t > heavy_parent( n, FlatTree::npos );
+    std::vector< double > path_sums( n * thetas.size(), 0.0 );
+    std::vector< size_t > cut( n, FlatTree::npos );
+    std::vector< size_t > full( n, FlatTree::npos );
+
+    // l x^theta for all thetas, the grid ones by the recurrence of theta_curve()
+    std::vector< double > terms( thetas.size() );
+    auto const power_terms = [&]( double const l, double const x, std::vector< double >& result ){
+        for( size_t t = 0; t < fixed; ++t ) {
+            result[ t ] = l * std::pow( x, thetas[ t ] );
+        }
+        if( metrics.grid.steps > 0 ) {
+            auto power        = std::exp( metrics.grid.from * std::log( x ));
+            auto const factor = std::exp( metrics.grid.step_width() * std::log( x ));
+            for( size_t t = fixed; t < thetas.size(); ++t ) {
+                result[ t ] = l * power;
+                power *= factor;
+            }
+        }
+    };
+
+    result.positions.clear();
+    result.clade_mass.clear();
+    result.rows.clear();
+
+    for( size_t pos = 0; pos < n; ++pos ) {
+        if( tree.is_leaf( pos )) {
+            continue;
+        }
+        auto* clade_sums = &sums[ pos * width ];
+
+        for( auto const child : tree.children_of( pos ) ) {
+            distal[ pos ] += distal[ child ] + masses[ child ];
+            if( heavy[ pos ] == FlatTree::npos or distal[ child ] > distal[ heavy[ pos ]] ) {
+                heavy[ pos ] = child;
+            }
+
+            auto const* child_sums = &sums[ child * width ];
+            for( size_t k = 0; k < width; ++k ) {
+                clade_sums[ k ] += child_sums[ k ];
+            }
+
+            // the terms of the child edge itself, also as the top of its heavy path
+            auto* child_path = &path_sums[ child * thetas.size() ];
+            if( heavy[ child ] != FlatTree::npos ) {
+                auto const* below = &path_sums[ heavy[ child ] * thetas.size() ];
+                std::copy( below, below + thetas.size(), child_path );
+            }
+            auto const d = distal[ child ];
+            if( d <= 0.0 ) {
+                continue;
+            }
+            auto const l = tree.branch_length[ child ];
+            clade_sums[ 0 ] += l * d;
+            clade_sums[ 1 ] += l * d * std::log( d );
+            clade_sums[ 2 ] += l * d * d;
+            power_terms( l, d, terms );
+            for( size_t t = 0; t < thetas.size(); ++t ) {
+                clade_sums[ 3 + t ] += terms[ t ];
+                child_path[ t ]     += terms[ t ];
+            }
+        }
+        heavy_parent[ heavy[ pos ]] = pos;
+
+        auto const mass = distal[ pos ];
+        if( mass <= 0.0 ) {
+            continue;
+        }
+        auto* row = values.data();
+        row[0] = -( clade_sums[ 1 ] - std::log( mass ) * clade_sums[ 0 ] ) / mass;
+        row[1] = clade_sums[ 0 ] / mass - clade_sums[ 2 ] / ( mass * mass );
+        for( size_t t = 0; t < thetas.size(); ++t ) {
+            row[ 2 + t ] = clade_sums[ 3 + t ];
+        }
+
+        // edges with more than half of the mass of the clade, where min(d, M - d) = M - d. they are
+        // the heavy path from the heavy child down to the cut, whose d^theta terms are removed via
+        // the suffix sums, and whose leading edges down to full hold all of the mass.
+        auto const h = heavy[ pos ];
+        auto const all_mass = [&]( size_t const e ){
+            return equals_approx( distal[ e ] / mass, 1.0 );
+        };
+        if( distal[ h ] > mass / 2.0 ) {
+            auto& c = cut[ pos ];
+            c = cut[ h ] != FlatTree::npos ? cut[ h ] : h;
+            while( not( distal[ c ] > mass / 2.0 )) {
+                c = heavy_parent[ c ];
+            }
+            auto& f = full[ pos ];
+            if( all_mass( h )) {
+                f = full[ h ] != FlatTree::npos ? full[ h ] : h;
+                while( not all_mass( f )) {
+                    f = heavy_parent[ f ];
+                }
+            }
+
+            auto const* path_top    = &path_sums[ h * thetas.size() ];
+            auto const* path_bottom = heavy[ c ] != FlatTree::npos ? &path_sums[ heavy[ c ] * thetas.size() ] : nullptr;
+            for( size_t t = 0; t < thetas.size(); ++t ) {
+                row[ 2 + t ] -= path_top[ t ] - ( path_bottom ? path_bottom[ t ] : 0.0 );
+            }
+
+            // the edges with mass on both sides, between full and the cut
+            if( f != c ) {
+                for( auto e = ( f == FlatTree::npos ? h : heavy[ f ] );; e = heavy[ e ] ) {
+                    power_terms( tree.branch_length[ e ], mass - distal[ e ], terms );
+                    for( size_t t = 0; t < thetas.size(); ++t ) {
+                        row[ 2 + t ] += terms[ t ];
+                    }
+                    if( e == c ) {
+                        break;
+                    }
+                }
+            }
+        }
+        for( size_t t = 0; t < thetas.size(); ++t ) {
+            row[ 2 + t ] *= std::pow( 2.0 / mass, thetas[ t ] );
+        }
+
+        result.positions.push_back( pos );
+        result.clade_mass.push_back( mass );
+        result.rows.resize( result.rows.size() + metrics.row_size() );
+        auto* result_row = &result.rows[ result.rows.size() - metrics.row_size() ];
+
+        // all metrics are non-negative, but the differences of the sums can round below zero
+        for( size_t k = 0; k < metrics.row_size(); ++k ) {
+            result_row[ k ] = std::max( values[ value_index[ k ]], 0.0 );
+        }
+    }
+}
+
+#endif // include guard
@@ -0,0 +1,59 @@
+#ifndef DIVERSITY_COUNT_ALLOCATIONS_H_
+#define DIVERSITY_COUNT_ALLOCATIONS_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "profile.hpp"
+
+#include <cstdlib>
+#include <new>
+
+// =================================================================================================
+//     Allocation Counting
+// =================================================================================================
+
+// Replaces the global operator new, so that ProfileTimer can report the allocations of each phase.
+// This costs one thread local increment per allocation, in every run of the executable, whether
+// it profiles or not. It is thus only compiled in with the CMake option APPS_COUNT_ALLOCATIONS.
+// Include this in the file with the main function only, as the replacement has to be defined
+// exactly once per executable.
+
+#ifdef APPS_COUNT_ALLOCATIONS
+
+void* operator new( size_t size )
+{
+    ++thread_allocation_count();
+    if( void* ptr = std::malloc( size == 0 ? 1 : size )) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete( void* ptr ) noexcept
+{
+    std::free( ptr );
+}
+
+#endif // APPS_COUNT_ALLOCATIONS
+
+#endif // include guard
@@ -0,0 +1,228 @@
+#ifndef DIVERSITY_FLAT_MASSES_H_
+#define DIVERSITY_FLAT_MASSES_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "bwpd.hpp"
+#include "flat_tree.hpp"
+#include "functions.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+// =================================================================================================
+//     Flat Masses
+// =================================================================================================
+
+/**
+ * Point masses of a sample along the edges of a FlatTree, as a flat replacement for the
+ * `std::map` per edge of a MassTree.
+ *
+ * The masses of the edge at position `p` are in `[ offset[p], offset[p+1] )`, sorted by their
+ * distance from the proximal end of the edge, with distinct points.
+ */
+struct FlatMasses
+{
+    std::vector< size_t > offset;
+    std::vector< double > points;
+    std::vector< double > masses;
+
+    size_t size() const
+    {
+        return offset.empty() ? 0 : offset.size() - 1;
+    }
+
+    /**
+     * Sum of the masses per position, as input for BWPD().
+     */
+    void edge_masses( std::vector< double >& result ) const
+    {
+        result.assign( size(), 0.0 );
+        for( size_t pos = 0; pos < size(); ++pos ) {
+            for( size_t i = offset[ pos ]; i < offset[ pos + 1 ]; ++i ) {
+                result[ pos ] += masses[ i ];
+            }
+        }
+    }
+};
+
+/**
+ * Collects point masses in any order, and turns them into FlatMasses.
+ *
+ * All buffers keep their capacity across reset() calls, so that one builder per thread serves as
+ * an arena for all samples that the thread evaluates, and allocates nothing once it has seen the
+ * largest sample.
+ */
+class FlatMassBuilder
+{
+public:
+
+    void reset( size_t const positions )
+    {
+        positions_ = positions;
+        entry_position_.clear();
+        entry_point_.clear();
+        entry_mass_.clear();
+    }
+
+    void add( size_t const position, double const point, double const mass )
+    {
+        assert( position < positions_ );
+        entry_position_.push_back( position );
+        entry_point_.push_back( point );
+        entry_mass_.push_back( mass );
+    }
+
+    /**
+     * Write the collected masses to @p result, reusing its storage. Masses at the same point of
+     * an edge are summed up in the order in which they were added, as a `std::map` would.
+     * If @p normalize is set, the masses are divided by their total afterwards.
+     */
+    void build( FlatMasses& result, bool const normalize )
+    {
+        auto const n = entry_position_.size();
+
+        // counting sort of the entries by position, which keeps the order of addition
+        result.offset.assign( positions_ + 1, 0 );
+        for( size_t i = 0; i < n; ++i ) {
+            ++result.offset[ entry_position_[ i ] + 1 ];
+        }
+        for( size_t pos = 0; pos < positions_; ++pos ) {
+            result.offset[ pos + 1 ] += result.offset[ pos ];
+        }
+        order_.resize( n );
+        cursor_.assign( result.offset.begin(), result.offset.end() - 1 );
+        for( size_t i = 0; i < n; ++i ) {
+            order_[ cursor_[ entry_position_[ i ]]++ ] = i;
+        }
+
+        // per edge, stable sort by point, and merge equal points
+        result.points.clear();
+        result.masses.clear();
+        size_t begin = 0;
+        for( size_t pos = 0; pos < positions_; ++pos ) {
+            auto const end = result.offset[ pos + 1 ];
+            auto const by_point = [&]( size_t a, size_t b ){
+                return entry_point_[ a ] < entry_point_[ b ];
+            };
+            if( end - begin <= 32 ) {
+                // few masses per edge are the common case, and need no temporary buffer this way
+                for( size_t k = begin + 1; k < end; ++k ) {
+                    auto const value = order_[ k ];
+                    auto j = k;
+                    while( j > begin and by_point( value, order_[ j - 1 ] )) {
+                        order_[ j ] = order_[ j - 1 ];
+                        --j;
+                    }
+                    order_[ j ] = value;
+                }
+            } else {
+                std::stable_sort( order_.begin() + begin, order_.begin() + end, by_point );
+            }
+
+            result.offset[ pos ] = result.points.size();
+            for( size_t k = begin; k < end; ++k ) {
+                auto const i = order_[ k ];
+                if( result.points.size() > result.offset[ pos ] and result.points.back() == entry_point_[ i ] ) {
+                    result.masses.back() += entry_mass_[ i ];
+                } else {
+                    result.points.push_back( entry_point_[ i ] );
+                    result.masses.push_back( entry_mass_[ i ] );
+                }
+            }
+            begin = end;
+        }
+        result.offset[ positions_ ] = result.points.size();
+
+        if( normalize ) {
+            double total = 0.0;
+            for( auto const mass : result.masses ) {
+                total += mass;
+            }
+            if( total > 0.0 ) {
+                for( auto& mass : result.masses ) {
+                    mass /= total;
+                }
+            }
+        }
+    }
+
+private:
+
+    size_t positions_ = 0;
+    std::vector< size_t > entry_position_;
+    std::vector< double > entry_point_;
+    std::vector< double > entry_mass_;
+
+    std::vector< size_t > order_;
+    std::vector< size_t > cursor_;
+};
+
+// =================================================================================================
+//     Flat Mass BWPD
+// =================================================================================================
+
+/**
+ * BWPD-style branch length sum of the point masses on the edge at @p pos, added to the
+ * accumulator. Same as distal_edge_sum() for a MassTree edge, but as a linear scan.
+ */
+template< class accumulator_t >
+void distal_edge_sum( FlatMasses const& masses, size_t const pos, accumulator_t& accumulator )
+{
+    double dragged_mass = 0.0;
+    auto const begin = masses.offset[ pos ];
+
+    // starting with the most distal mass, each mass is dragged along to the next proximal one
+    for( auto i = masses.offset[ pos + 1 ]; i > begin; --i ) {
+        auto const k = i - 1;
+        dragged_mass += masses.masses[ k ];
+
+        assert( dragged_mass > 0.0 or equals_approx( dragged_mass, 0.0 ) );
+        assert( dragged_mass < 1.0 or equals_approx( dragged_mass, 1.0 ) );
+
+        auto const branch_length = k > begin ? masses.points[ k ] - masses.points[ k - 1 ] : masses.points[ k ];
+        assert( branch_length > 0.0 );
+
+        accumulator.add( branch_length, dragged_mass );
+    }
+}
+
+/**
+ * BWPD-style metrics of normalized point masses, where the masses of edges without any distal
+ * mass are additionally resolved along the edge via distal_edge_sum(), as in MassTreeBWPD().
+ */
+template< class accumulator_t >
+void FlatMassBWPD( FlatTree const& flat_tree, FlatMasses const& masses, accumulator_t& accumulator )
+{
+    assert( masses.size() == flat_tree.size() );
+    std::vector< double > mass_per_edge;
+    masses.edge_masses( mass_per_edge );
+
+    BWPD( flat_tree, mass_per_edge, 1.0, accumulator, [&]( size_t const pos, accumulator_t& acc ){
+        distal_edge_sum( masses, pos, acc );
+    });
+}
+
+#endif // include guard
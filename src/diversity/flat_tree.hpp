@@ -0,0 +1,194 @@
+#ifndef DIVERSITY_FLAT_TREE_H_
+#define DIVERSITY_FLAT_TREE_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "genesis/genesis.hpp"
+
+#include <cassert>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// =================================================================================================
+//     Flat Tree
+// =================================================================================================
+
+/**
+ * Children of one position, as a range over FlatTree::children.
+ */
+struct FlatChildren
+{
+    size_t const* first;
+    size_t const* last;
+
+    size_t const* begin() const
+    {
+        return first;
+    }
+
+    size_t const* end() const
+    {
+        return last;
+    }
+
+    size_t size() const
+    {
+        return static_cast< size_t >( last - first );
+    }
+};
+
+/**
+ * Postorder topology of a tree, stored as plain arrays (structure-of-arrays).
+ *
+ * Each edge of the tree gets a position in postorder, so that the children of an edge always come
+ * before the edge itself. All per-position arrays are indexed by that position. The root node does
+ * not have an edge, so the edges adjacent to it are the only ones that are not a child of another
+ * position.
+ *
+ * Nodes can have any number of children. The children of all positions are stored back to back
+ * in postorder (compressed sparse rows), so that multifurcations do not need to be resolved into
+ * extra zero length edges, and bifurcating trees are scanned just as sequentially as before.
+ *
+ * This is built once per reference tree, and then shared by every sample placed on it. The metric
+ * computations are then linear scans over these arrays instead of traversals of the pointer-based
+ * genesis Tree.
+ */
+struct FlatTree
+{
+    enum : size_t {
+        npos = std::numeric_limits< size_t >::max()
+    };
+
+    /**
+     * Genesis edge index of each position.
+     */
+    std::vector< size_t > edge_index;
+
+    /**
+     * The children of position `p` are `children[ child_offset[p] ] ... children[ child_offset[p+1] - 1 ]`,
+     * none for leaf edges. child_offset has one more entry than there are positions.
+     */
+    std::vector< size_t > child_offset = std::vector< size_t >( 1, 0 );
+    std::vector< size_t > children;
+
+    std::vector< double > branch_length;
+
+    /**
+     * Inverse of edge_index: the position of each genesis edge index.
+     */
+    std::vector< size_t > position;
+
+    size_t size() const
+    {
+        return edge_index.size();
+    }
+
+    bool is_leaf( size_t const pos ) const
+    {
+        return child_offset[ pos ] == child_offset[ pos + 1 ];
+    }
+
+    FlatChildren children_of( size_t const pos ) const
+    {
+        auto const data = children.data();
+        return FlatChildren{ data + child_offset[ pos ], data + child_offset[ pos + 1 ] };
+    }
+
+    /**
+     * Append the next position in postorder, whose children have to be added already.
+     */
+    template< class iterator_t >
+    void add( size_t const index, double const length, iterator_t children_begin, iterator_t children_end )
+    {
+        edge_index.push_back( index );
+        branch_length.push_back( length );
+        children.insert( children.end(), children_begin, children_end );
+        child_offset.push_back( children.size() );
+    }
+
+    void clear()
+    {
+        edge_index.clear();
+        child_offset.assign( 1, 0 );
+        children.clear();
+        branch_length.clear();
+        position.clear();
+    }
+};
+
+/**
+ * Build the FlatTree of a genesis tree, taking the branch lengths from the given edge data type.
+ */
+template< class edge_data_t >
+FlatTree make_flat_tree( genesis::tree::Tree const& tree )
+{
+    using namespace genesis::tree;
+
+    FlatTree result;
+    auto const edge_count = tree.edge_count();
+    result.edge_index.reserve( edge_count );
+    result.child_offset.reserve( edge_count + 1 );
+    result.children.reserve( edge_count );
+    result.branch_length.reserve( edge_count );
+    result.position.assign( edge_count, FlatTree::npos );
+
+    std::vector< size_t > children;
+    for( auto const& it : postorder( tree ) ) {
+        // the root does not have an edge of its own
+        if( it.is_last_iteration() ) { continue; }
+
+        auto const& edge = it.edge();
+        result.position[ edge.index() ] = result.size();
+
+        // the children have already been visited in postorder, so their positions are known.
+        // the link of the node points towards the root, all others lead to the children.
+        children.clear();
+        auto const& node = it.node();
+        for( auto link = &node.link().next(); link != &node.link(); link = &link->next() ) {
+            children.push_back( result.position[ link->edge().index() ] );
+        }
+        result.add( edge.index(), edge.data< edge_data_t >().branch_length, children.begin(), children.end() );
+    }
+
+    if( result.size() != edge_count ) {
+        throw std::runtime_error("count != tree.edge_count()");
+    }
+    return result;
+}
+
+/**
+ * Reorder a per-edge vector (indexed by genesis edge index) into FlatTree positions.
+ */
+inline std::vector< double > to_positions( FlatTree const& tree, std::vector< double > const& per_edge )
+{
+    assert( per_edge.size() == tree.size() );
+    std::vector< double > result( tree.size() );
+    for( size_t pos = 0; pos < tree.size(); ++pos ) {
+        result[ pos ] = per_edge[ tree.edge_index[ pos ] ];
+    }
+    return result;
+}
+
+#endif // include guard
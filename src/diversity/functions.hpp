@@ -0,0 +1,50 @@
+#ifndef DIVERSITY_FUNCTIONS_H_
+#define DIVERSITY_FUNCTIONS_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include <cmath>
+
+// =================================================================================================
+//     g-Functions
+// =================================================================================================
+
+inline bool equals_approx( double const a, double const b , double const epsilon=1e-10)
+{
+    return std::abs( a - b ) < epsilon;
+}
+
+inline double phylo_entropy_g( double const x )
+{
+    if( equals_approx( x, 0.0 ) ) {
+        return 0.0;
+    }
+    return x * std::log(x);
+}
+
+inline double phylo_quad_entropy_g( double const x )
+{
+    return x * (1.0 - x);
+}
+
+#endif // include guard
@@ -0,0 +1,278 @@
+#ifndef DIVERSITY_GZIP_INPUT_H_
+#define DIVERSITY_GZIP_INPUT_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined( APPS_ZLIB )
+#   include <zlib.h>
+#endif
+
+// =================================================================================================
+//     Gzip Detection
+// =================================================================================================
+
+/**
+ * Whether @p file starts with the gzip magic bytes, independent of its extension.
+ */
+inline bool is_gzip_file( std::string const& file )
+{
+    std::ifstream in( file, std::ios::binary );
+    unsigned char magic[2] = { 0, 0 };
+    in.read( reinterpret_cast< char* >( magic ), 2 );
+    return in and magic[0] == 0x1f and magic[1] == 0x8b;
+}
+
+#if defined( APPS_ZLIB )
+
+// =================================================================================================
+//     BGZF Blocks
+// =================================================================================================
+
+/**
+ * One block of a BGZF file (blocked gzip, as written by bgzip and htslib): a complete gzip member
+ * of at most 64kB, whose header stores its compressed size, and whose trailer its uncompressed size.
+ */
+struct GzipBlock
+{
+    size_t in_offset;
+    size_t in_size;
+    size_t out_offset;
+    size_t out_size;
+    uint32_t crc;
+};
+
+inline uint32_t read_little_endian( unsigned char const* p, size_t const bytes )
+{
+    uint32_t result = 0;
+    for( size_t i = bytes; i > 0; --i ) {
+        result = ( result << 8 ) | p[ i - 1 ];
+    }
+    return result;
+}
+
+/**
+ * Split @p data into its BGZF blocks. Returns false if it is not a BGZF file, that is, if any
+ * member does not carry the `BC` extra field with its size.
+ */
+inline bool bgzf_blocks( std::string const& data, std::vector< GzipBlock >& blocks )
+{
+    auto const bytes = reinterpret_cast< unsigned char const* >( data.data() );
+    blocks.clear();
+    size_t in = 0;
+    size_t out = 0;
+    while( in < data.size() ) {
+        auto const p = bytes + in;
+        if( data.size() - in < 18 or p[0] != 0x1f or p[1] != 0x8b or p[2] != 8 or ( p[3] & 4 ) == 0 ) {
+            return false;
+        }
+
+        // the BC subfield holds the total block size minus one
+        auto const xlen = read_little_endian( p + 10, 2 );
+        size_t block_size = 0;
+        for( size_t x = 0; x + 4 <= xlen and 12 + x + 4 <= data.size() - in; ) {
+            auto const slen = read_little_endian( p + 12 + x + 2, 2 );
+            if( p[ 12 + x ] == 'B' and p[ 12 + x + 1 ] == 'C' and slen == 2 ) {
+                block_size = read_little_endian( p + 12 + x + 4, 2 ) + 1;
+            }
+            x += 4 + slen;
+        }
+        if( block_size < 12 + xlen + 8 or block_size > data.size() - in ) {
+            return false;
+        }
+
+        GzipBlock block;
+        block.in_offset  = in + 12 + xlen;
+        block.in_size    = block_size - 12 - xlen - 8;
+        block.out_offset = out;
+        block.out_size   = read_little_endian( p + block_size - 4, 4 );
+        block.crc        = read_little_endian( p + block_size - 8, 4 );
+        blocks.push_back( block );
+
+        in  += block_size;
+        out += block.out_size;
+    }
+    return not blocks.empty();
+}
+
+/**
+ * Inflate all blocks into @p result, distributed over the threads. As the uncompressed size of
+ * each block is known upfront, every block is inflated straight into its final place.
+ */
+inline void inflate_bgzf( std::string const& data, std::vector< GzipBlock > const& blocks, std::string& result )
+{
+    result.resize( blocks.back().out_offset + blocks.back().out_size );
+    parallel_for( blocks.size(), [&]( size_t const b ) {
+        auto const& block = blocks[ b ];
+        if( block.out_size == 0 ) {
+            return;
+        }
+        auto const out = reinterpret_cast< unsigned char* >( &result[ block.out_offset ] );
+
+        z_stream stream;
+        std::memset( &stream, 0, sizeof( stream ));
+        if( inflateInit2( &stream, -MAX_WBITS ) != Z_OK ) {
+            throw std::runtime_error( "Cannot initialize zlib" );
+        }
+        stream.next_in   = reinterpret_cast< Bytef* >( const_cast< char* >( data.data() + block.in_offset ));
+        stream.avail_in  = static_cast< uInt >( block.in_size );
+        stream.next_out  = out;
+        stream.avail_out = static_cast< uInt >( block.out_size );
+        auto const status = inflate( &stream, Z_FINISH );
+        inflateEnd( &stream );
+
+        if( status != Z_STREAM_END or stream.avail_out != 0
+            or crc32( crc32( 0, Z_NULL, 0 ), out, static_cast< uInt >( block.out_size )) != block.crc
+        ) {
+            throw std::runtime_error( "Corrupt gzip block" );
+        }
+    });
+}
+
+// =================================================================================================
+//     Gzip Streams
+// =================================================================================================
+
+/**
+ * Inflate a general gzip file, which might consist of several concatenated members, in one pass.
+ */
+inline void inflate_gzip( std::string const& data, std::string& result )
+{
+    z_stream stream;
+    std::memset( &stream, 0, sizeof( stream ));
+    if( inflateInit2( &stream, 16 + MAX_WBITS ) != Z_OK ) {
+        throw std::runtime_error( "Cannot initialize zlib" );
+    }
+
+    // the trailer of the last member has its size modulo 4GB, which is a good first guess
+    result.clear();
+    if( data.size() >= 4 ) {
+        result.reserve( read_little_endian( reinterpret_cast< unsigned char const* >( data.data() + data.size() - 4 ), 4 ));
+    }
+
+    // zlib counts in 32 bit, so larger files are handed over in pieces
+    size_t consumed = 0;
+    stream.next_in  = reinterpret_cast< Bytef* >( const_cast< char* >( data.data() ));
+    stream.avail_in = 0;
+    char chunk[ 1 << 16 ];
+    int status = Z_OK;
+    while( true ) {
+        if( stream.avail_in == 0 and consumed < data.size() ) {
+            stream.avail_in = static_cast< uInt >( std::min< size_t >( data.size() - consumed, 1u << 30 ));
+            consumed += stream.avail_in;
+        }
+        stream.next_out  = reinterpret_cast< Bytef* >( chunk );
+        stream.avail_out = sizeof( chunk );
+        status = inflate( &stream, Z_NO_FLUSH );
+        result.append( chunk, sizeof( chunk ) - stream.avail_out );
+
+        if( status == Z_STREAM_END and ( stream.avail_in > 0 or consumed < data.size() )) {
+            // the next member
+            inflateReset( &stream );
+        } else if( status != Z_OK ) {
+            break;
+        }
+    }
+    inflateEnd( &stream );
+    if( status != Z_STREAM_END ) {
+        throw std::runtime_error( "Corrupt or truncated gzip file" );
+    }
+}
+
+#endif // APPS_ZLIB
+
+// =================================================================================================
+//     Input Files
+// =================================================================================================
+
+/**
+ * The buffers of read_input_file() and its callers are kept per thread across files, so that
+ * reading many files does not allocate for each of them, but only up to this size. Beyond that,
+ * trim_input_buffer() releases them, so that a single large input does not stay allocated for the
+ * rest of the run.
+ */
+static size_t const input_buffer_limit = size_t( 64 ) << 20;
+
+template< class buffer_t >
+void trim_input_buffer( buffer_t& buffer )
+{
+    if( buffer.capacity() * sizeof( typename buffer_t::value_type ) > input_buffer_limit ) {
+        buffer_t().swap( buffer );
+    }
+}
+
+/**
+ * Read the whole content of @p file into @p result, decompressing it if it is gzipped.
+ *
+ * BGZF files are split into their blocks, which are inflated in parallel. Other gzip files are
+ * inflated in one stream. The samples are read by background threads (see OrderedPrefetcher) or
+ * in parallel, so that decompression overlaps parsing and computation either way.
+ * The compressed data is kept in a buffer per thread, see trim_input_buffer().
+ */
+inline void read_input_file( std::string const& file, std::string& result )
+{
+    std::ifstream in( file, std::ios::binary | std::ios::ate );
+    if( not in ) {
+        throw std::runtime_error( "Cannot read file " + file );
+    }
+    result.resize( static_cast< size_t >( in.tellg() ));
+    in.seekg( 0 );
+    in.read( &result[0], static_cast< std::streamsize >( result.size() ));
+
+    if( result.size() < 2 or static_cast< unsigned char >( result[0] ) != 0x1f
+        or static_cast< unsigned char >( result[1] ) != 0x8b
+    ) {
+        return;
+    }
+
+#if defined( APPS_ZLIB )
+    static thread_local std::string compressed;
+    static thread_local std::vector< GzipBlock > blocks;
+    compressed.swap( result );
+    try {
+        if( bgzf_blocks( compressed, blocks )) {
+            inflate_bgzf( compressed, blocks, result );
+        } else {
+            inflate_gzip( compressed, result );
+        }
+    } catch( std::exception const& e ) {
+        trim_input_buffer( compressed );
+        throw std::runtime_error( std::string( e.what() ) + ": " + file );
+    }
+    trim_input_buffer( compressed );
+    trim_input_buffer( blocks );
+#else
+    throw std::runtime_error( "Cannot read gzipped file " + file + ", as this was compiled without zlib." );
+#endif
+}
+
+#endif // include guard
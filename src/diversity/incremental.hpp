@@ -0,0 +1,253 @@
+#ifndef DIVERSITY_INCREMENTAL_H_
+#define DIVERSITY_INCREMENTAL_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "flat_tree.hpp"
+#include "functions.hpp"
+#include "metrics.hpp"
+#include "sparse.hpp"
+
+#include <cmath>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+// =================================================================================================
+//     Incremental Sample
+// =================================================================================================
+
+/**
+ * The masses of a sample that grows (or shrinks) batch by batch, such as the query counts of
+ * reads that are placed continuously, with metrics that can be queried at any time.
+ *
+ * Each edge keeps its absolute distal count c, the mass strictly below it. A placement of mass m
+ * adds m to the counts of the edges on its path to the root, and updates the sums
+ * `S1 = sum l c`, `S2 = sum l c^2`, `SL = sum l c log c` and `P = sum l [c > 0]` over all edges
+ * by the deltas of those edges. This costs `O(depth)` per placement. Every edge on the path
+ * changes its term, so reading c from a Fenwick tree over the Euler tour instead of keeping it per
+ * edge would only add a log factor.
+ *
+ * The sums do not depend on the total N, so that a batch does not touch the other edges. With
+ * `x = c / N`, a query then takes constant time for the metrics that follow from them:
+ *
+ *     entropy     -sum l x log x = -( SL - log N * S1 ) / N
+ *     quadratic   sum l x (1 - x) = S1 / N - S2 / N^2
+ *     bwpd:0      P, minus the edges above all of the mass, if all queries are placed
+ *     faith       the same as bwpd:0
+ *     hill:q      for q = 0, 1 and 2, from T = S1 / N and the sums above
+ *
+ * Other metrics, that is, BWPD with theta > 0, other Hill orders, and the theta grid, depend on
+ * `min( c, N - c )` or on other powers of c. For those, metrics() evaluates the whole row on the
+ * occupied positions via the sparse BWPD, in `O(k log k)` for `k` occupied positions, or `O(n)`
+ * via the dense scan once the sample occupies SparseTree::dense_fraction of the edges.
+ */
+class IncrementalSample
+{
+public:
+
+    explicit IncrementalSample( SparseTree const& sparse_tree )
+        : sparse_tree_( sparse_tree )
+        , distal_( sparse_tree.flat_tree().size(), 0.0 )
+    {}
+
+    /**
+     * Add a batch of masses, given as FlatTree positions and their masses, and the number of
+     * queries in the batch, which might include queries without any placement.
+     */
+    void add( SparseMasses const& batch, double const total )
+    {
+        update_( batch, total, 1.0 );
+    }
+
+    /**
+     * Remove a batch that was added before.
+     */
+    void remove( SparseMasses const& batch, double const total )
+    {
+        update_( batch, total, -1.0 );
+    }
+
+    double total() const
+    {
+        return total_;
+    }
+
+    /**
+     * Whether metrics() evaluates all metrics of @p metric_set from the running sums.
+     */
+    static bool from_sums( MetricSet const& metric_set )
+    {
+        if( metric_set.grid.steps > 0 ) {
+            return false;
+        }
+        for( auto const& spec : metric_set.specs ) {
+            auto const p = spec.parameter;
+            bool const supported = spec.kind == MetricSpec::entropy
+                or spec.kind == MetricSpec::quadratic
+                or spec.kind == MetricSpec::faith
+                or ( spec.kind == MetricSpec::bwpd and p == 0.0 )
+                or ( spec.kind == MetricSpec::hill and ( p == 0.0 or p == 1.0 or p == 2.0 ));
+            if( not supported ) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * All metrics of the current state of the sample.
+     */
+    std::vector< double > metrics( MetricSet const& metric_set ) const
+    {
+        if( total_ > 0.0 and from_sums( metric_set )) {
+            std::vector< double > result;
+            for( auto const& spec : metric_set.specs ) {
+                result.push_back( value_from_sums_( spec ));
+            }
+            return result;
+        }
+
+        SparseMasses current;
+        for( auto const& entry : occupied_ ) {
+            current.add( entry.first, entry.second );
+        }
+        MetricAccumulator accumulator( metric_set );
+        if( total_ > 0.0 ) {
+            BWPD( sparse_tree_, current, total_, accumulator );
+        }
+        return accumulator.row();
+    }
+
+private:
+
+    void update_( SparseMasses const& batch, double const total, double const sign )
+    {
+        auto const& tree = sparse_tree_.flat_tree();
+        for( size_t i = 0; i < batch.size(); ++i ) {
+            auto const pos  = batch.positions[ i ];
+            auto const mass = sign * batch.masses[ i ];
+
+            auto& occupied = occupied_[ pos ];
+            occupied += mass;
+            if( occupied < 0.0 and not equals_approx( occupied, 0.0 )) {
+                throw std::runtime_error( "Cannot remove more mass from an edge than was added to it." );
+            }
+            if( equals_approx( occupied, 0.0 )) {
+                occupied_.erase( pos );
+            }
+            placed_ += mass;
+
+            for( auto e = sparse_tree_.parent( pos ); e != FlatTree::npos; e = sparse_tree_.parent( e )) {
+                auto& count = distal_[ e ];
+                add_terms_( tree.branch_length[ e ], count, -1.0 );
+                count += mass;
+                if( equals_approx( count, 0.0 )) {
+                    count = 0.0;
+                }
+                add_terms_( tree.branch_length[ e ], count, 1.0 );
+            }
+        }
+        total_ += sign * total;
+        if( equals_approx( total_, 0.0 )) {
+            total_ = 0.0;
+        }
+        if( occupied_.empty() ) {
+            placed_ = 0.0;
+        }
+    }
+
+    void add_terms_( double const length, double const count, double const sign )
+    {
+        if( count <= 0.0 ) {
+            return;
+        }
+        sum_c_       += sign * length * count;
+        sum_c2_      += sign * length * count * count;
+        sum_c_log_c_ += sign * length * count * std::log( count );
+        support_     += sign * length;
+    }
+
+    /**
+     * Length of the edges that have all of the mass on their distal side, that is, the path from
+     * the lowest edge above all occupied positions to the root. Only if all queries are placed.
+     */
+    double full_length_() const
+    {
+        if( occupied_.empty() or not equals_approx( placed_ / total_, 1.0 )) {
+            return 0.0;
+        }
+        auto const lca = sparse_tree_.lca( occupied_.begin()->first, occupied_.rbegin()->first );
+        if( lca == FlatTree::npos ) {
+            return 0.0;
+        }
+
+        // an occupied lca keeps its own mass on its proximal side
+        if( occupied_.count( lca ) > 0 ) {
+            return sparse_tree_.root_distance( sparse_tree_.parent( lca ));
+        }
+        return sparse_tree_.root_distance( lca );
+    }
+
+    double value_from_sums_( MetricSpec const& spec ) const
+    {
+        auto const n = total_;
+        auto const entropy = ( sum_c_log_c_ - std::log( n ) * sum_c_ ) / n;
+        auto const t = sum_c_ / n;
+        switch( spec.kind ) {
+            case MetricSpec::entropy:
+                return -entropy;
+            case MetricSpec::quadratic:
+                return sum_c_ / n - sum_c2_ / ( n * n );
+            case MetricSpec::bwpd:
+            case MetricSpec::faith:
+                return support_ - full_length_();
+            case MetricSpec::hill:
+                if( t <= 0.0 ) {
+                    return 0.0;
+                }
+                if( spec.parameter == 0.0 ) {
+                    return support_;
+                }
+                if( spec.parameter == 1.0 ) {
+                    return t * std::exp( -entropy / t );
+                }
+                return t * t / ( sum_c2_ / ( n * n ));
+        }
+        return 0.0;
+    }
+
+    SparseTree const& sparse_tree_;
+    std::map< size_t, double > occupied_;
+    double total_  = 0.0;
+    double placed_ = 0.0;
+
+    // absolute distal count per position, and the sums over all edges, see above
+    std::vector< double > distal_;
+    double sum_c_       = 0.0;
+    double sum_c2_      = 0.0;
+    double sum_c_log_c_ = 0.0;
+    double support_     = 0.0;
+};
+
+#endif // include guard
@@ -0,0 +1,99 @@
+#ifndef DIVERSITY_MASS_TREE_BWPD_H_
+#define DIVERSITY_MASS_TREE_BWPD_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "genesis/genesis.hpp"
+
+#include "bwpd.hpp"
+#include "flat_tree.hpp"
+#include "functions.hpp"
+
+#include <cassert>
+#include <iterator>
+#include <vector>
+
+// =================================================================================================
+//     Mass Tree BWPD
+// =================================================================================================
+
+/**
+ * BWPD-style branch length sum of mass-edges (made by placements for example)
+ * on the given edge of the reference tree, added to the given accumulator.
+ */
+template< class accumulator_t >
+void distal_edge_sum( genesis::tree::MassTreeEdge const& edge, accumulator_t& accumulator )
+{
+    double dragged_mass = 0.0;
+    auto const& masses = edge.data< genesis::tree::MassTreeEdgeData >().masses;
+
+    // iterate in reverse order through the map of masses, starting with the most distal mass
+    for( auto it = masses.rbegin(); it != masses.rend(); ++it ) {
+        auto prox_length    = it->first;
+
+        // the "distal" mass as it gets dragged along the path of masses (a monofurcating subtree of sorts)
+        dragged_mass += it->second;
+
+        assert( dragged_mass > 0.0 or equals_approx( dragged_mass, 0.0 ) );
+        assert( dragged_mass < 1.0 or equals_approx( dragged_mass, 1.0 ) );
+
+        double branch_length = prox_length;
+
+        // look ahead (or rather, behind from the perspective of the container) to get the next
+        // proximal length, as <current prox length> - <next prox length> = "branch length"
+        // of the mass
+        auto next_it = std::next( it );
+        if( next_it != masses.rend() ) {
+            auto next_prox_length = next_it->first;
+            branch_length = prox_length - next_prox_length;
+        }
+
+        assert( branch_length > 0.0 );
+
+        // add the sum according to the metrics
+        accumulator.add( branch_length, dragged_mass );
+
+    }
+}
+
+/**
+ * BWPD-style metrics of a mass tree, where the masses of edges without any distal mass are
+ * additionally resolved along the edge via distal_edge_sum().
+ */
+template< class accumulator_t >
+void MassTreeBWPD( genesis::tree::MassTree const& mass_tree, accumulator_t& accumulator )
+{
+    auto const flat_tree = make_flat_tree< genesis::tree::MassTreeEdgeData >( mass_tree );
+
+    // the masses are normalized, so D(i) is the distal mass itself
+    auto const mass_per_edge = to_positions( flat_tree, genesis::tree::mass_tree_mass_per_edge( mass_tree ) );
+
+    // "recurse" to get the part of the sum coming from the masses located on the immediate
+    // child edges, which are treated differently since they are not directly in the tree
+    // structure
+    BWPD( flat_tree, mass_per_edge, 1.0, accumulator, [&]( size_t const pos, accumulator_t& acc ){
+        distal_edge_sum( mass_tree.edge_at( flat_tree.edge_index[ pos ] ), acc );
+    });
+}
+
+#endif // include guard
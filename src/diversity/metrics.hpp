@@ -0,0 +1,549 @@
+#ifndef DIVERSITY_METRICS_H_
+#define DIVERSITY_METRICS_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "functions.hpp"
+#include "theta_grid.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Metric Registry
+// =================================================================================================
+
+/**
+ * One metric of a result row. The @p parameter is the theta of BWPD, or the order q of the
+ * phylogenetic Hill number. The @p label replaces the default column name, if given.
+ */
+struct MetricSpec
+{
+    enum Kind {
+        entropy, quadratic, bwpd, faith, hill
+    };
+
+    Kind        kind;
+    double      parameter;
+    std::string label;
+};
+
+/**
+ * A metric that can be selected by name, see parse_metric_list().
+ */
+struct MetricInfo
+{
+    char const*      name;
+    MetricSpec::Kind kind;
+    bool             has_parameter;
+    char const*      description;
+};
+
+inline std::vector< MetricInfo > const& metric_registry()
+{
+    static std::vector< MetricInfo > const registry = {
+        { "entropy",   MetricSpec::entropy,   false, "phylogenetic entropy" },
+        { "quadratic", MetricSpec::quadratic, false, "phylogenetic quadratic entropy" },
+        { "bwpd",      MetricSpec::bwpd,      true,  "BWPD, as bwpd:theta with theta in [0,1]" },
+        { "faith",     MetricSpec::faith,     false, "Faith's PD of the spanning tree of the sample, the same as bwpd:0" },
+        { "hill",      MetricSpec::hill,      true,  "phylogenetic Hill number, as hill:q with order q >= 0" }
+    };
+    return registry;
+}
+
+/**
+ * One line per metric of the registry, for the usage text.
+ */
+inline std::string metric_registry_help()
+{
+    std::string result;
+    for( auto const& info : metric_registry() ) {
+        result += "    " + std::string( info.name ) + std::string( 12 - std::string( info.name ).size(), ' ' );
+        result += std::string( info.description ) + "\n";
+    }
+    return result;
+}
+
+/**
+ * Parse a comma separated list of metrics, such as `entropy,bwpd:0.5,hill:2`.
+ */
+inline std::vector< MetricSpec > parse_metric_list( std::string const& list )
+{
+    std::vector< MetricSpec > result;
+    std::istringstream items( list );
+    std::string item;
+    while( std::getline( items, item, ',' )) {
+        auto const colon = item.find( ':' );
+        auto const name  = item.substr( 0, colon );
+        auto const info  = std::find_if(
+            metric_registry().begin(), metric_registry().end(),
+            [&]( MetricInfo const& entry ){ return name == entry.name; }
+        );
+        if( info == metric_registry().end() ) {
+            throw std::runtime_error( "Unknown metric '" + name + "', expecting one of:\n" + metric_registry_help() );
+        }
+        if( info->has_parameter != ( colon != std::string::npos )) {
+            throw std::runtime_error(
+                "Invalid metric '" + item + "', " + name + ( info->has_parameter ? " needs" : " does not take" ) +
+                " a parameter"
+            );
+        }
+
+        MetricSpec spec{ info->kind, 0.0, "" };
+        if( info->has_parameter ) {
+            char* end = nullptr;
+            spec.parameter = std::strtod( item.c_str() + colon + 1, &end );
+            bool const valid = colon + 1 < item.size() and *end == '\0' and spec.parameter >= 0.0
+                and ( spec.kind != MetricSpec::bwpd or spec.parameter <= 1.0 );
+            if( not valid ) {
+                throw std::runtime_error( "Invalid parameter of metric '" + item + "'" );
+            }
+        }
+        result.push_back( spec );
+    }
+    if( result.empty() ) {
+        throw std::runtime_error( "No metrics given." );
+    }
+    return result;
+}
+
+inline std::string metric_name( MetricSpec const& spec )
+{
+    if( not spec.label.empty() ) {
+        return spec.label;
+    }
+    std::ostringstream name;
+    switch( spec.kind ) {
+        case MetricSpec::entropy:   name << "phylo_entropy";              break;
+        case MetricSpec::quadratic: name << "quadratic";                  break;
+        case MetricSpec::bwpd:      name << "bwpd_" << spec.parameter;    break;
+        case MetricSpec::faith:     name << "faith_pd";                   break;
+        case MetricSpec::hill:      name << "hill_" << spec.parameter;    break;
+    }
+    return name.str();
+}
+
+// =================================================================================================
+//     Metric Set
+// =================================================================================================
+
+/**
+ * The set of metrics that is computed per sample: the selected metrics, followed by one BWPD value
+ * per theta of the (optional) theta grid. A result row is laid out in exactly this order, with the
+ * entropy already negated.
+ */
+struct MetricSet
+{
+    std::vector< MetricSpec > specs;
+    ThetaGrid grid;
+
+    size_t row_size() const
+    {
+        return specs.size() + grid.steps;
+    }
+};
+
+/**
+ * The default metrics: phylogenetic entropy, quadratic entropy, and BWPD for each of the @p thetas.
+ */
+inline MetricSet default_metric_set( std::vector< double > const& thetas )
+{
+    MetricSet result;
+    result.specs.push_back({ MetricSpec::entropy, 0.0, "" });
+    result.specs.push_back({ MetricSpec::quadratic, 0.0, "" });
+    for( auto const theta : thetas ) {
+        result.specs.push_back({ MetricSpec::bwpd, theta, "" });
+    }
+    return result;
+}
+
+/**
+ * The default metrics of scrapp-diversity, with a plain `bwpd` column (theta = 1) in front of the
+ * BWPD @p thetas.
+ */
+inline MetricSet scrapp_metric_set( std::vector< double > const& thetas )
+{
+    auto result = default_metric_set( thetas );
+    result.specs.insert( result.specs.begin() + 2, MetricSpec{ MetricSpec::bwpd, 1.0, "bwpd" });
+    return result;
+}
+
+/**
+ * Names of the metrics of a result row, in the order of MetricAccumulator::write_row().
+ */
+inline std::vector< std::string > metric_names( MetricSet const& metrics )
+{
+    std::vector< std::string > result;
+    for( auto const& spec : metrics.specs ) {
+        result.push_back( metric_name( spec ));
+    }
+    for( size_t i = 0; i < metrics.grid.steps; ++i ) {
+        std::ostringstream name;
+        name << "bwpd_" << metrics.grid.theta( i );
+        result.push_back( name.str() );
+    }
+    return result;
+}
+
+/**
+ * Check that no two metrics of @p metrics share a column name, such as `bwpd:0.5` given twice,
+ * or also being a theta of the grid.
+ */
+inline void check_metric_names( MetricSet const& metrics )
+{
+    auto names = metric_names( metrics );
+    std::sort( names.begin(), names.end() );
+    auto const duplicate = std::adjacent_find( names.begin(), names.end() );
+    if( duplicate != names.end() ) {
+        throw std::runtime_error( "Metric " + *duplicate + " is selected more than once." );
+    }
+}
+
+// =================================================================================================
+//     Metric Kernels
+// =================================================================================================
+
+/*
+    Each metric is a sum of `length * term( x )` over the (length, x) terms of a sample. The terms,
+    and the powers in them, are types, so that the loop of each kernel of MetricAccumulator is
+    compiled for its own term: exponents 0, 1/2 and 1, as well as the integral exponents up to 4,
+    do not call std::pow, and the checks for the spanning tree of the sample are inlined.
+*/
+
+struct ZeroPower
+{
+    double operator()( double ) const
+    {
+        return 1.0;
+    }
+};
+
+struct LinearPower
+{
+    double operator()( double const x ) const
+    {
+        return x;
+    }
+};
+
+struct SqrtPower
+{
+    double operator()( double const x ) const
+    {
+        return std::sqrt( x );
+    }
+};
+
+/**
+ * `x^exponent` for a fixed integral exponent, as a chain of multiplications.
+ */
+template< unsigned exponent >
+struct IntegerPower
+{
+    double operator()( double const x ) const
+    {
+        return x * IntegerPower< exponent - 1 >()( x );
+    }
+};
+
+template<>
+struct IntegerPower< 1 >
+{
+    double operator()( double const x ) const
+    {
+        return x;
+    }
+};
+
+struct RealPower
+{
+    double exponent;
+
+    double operator()( double const x ) const
+    {
+        return std::pow( x, exponent );
+    }
+};
+
+struct EntropyTerm
+{
+    double operator()( double const x ) const
+    {
+        return phylo_entropy_g( x );
+    }
+};
+
+struct QuadraticTerm
+{
+    double operator()( double const x ) const
+    {
+        return phylo_quad_entropy_g( x );
+    }
+};
+
+/**
+ * `(2 min(x, 1 - x))^theta` on the edges in the spanning tree of the sample, that is, where the
+ * fraction x is neither 0 nor 1.
+ */
+template< class power_t >
+struct BwpdTerm
+{
+    power_t power;
+
+    double operator()( double const x ) const
+    {
+        if( equals_approx( x, 0.0 ) or equals_approx( x, 1.0 )) {
+            return 0.0;
+        }
+        return power( 2 * std::min( x, 1.0 - x ));
+    }
+};
+
+/**
+ * `x^q` on the edges with any mass on their distal side.
+ */
+template< class power_t >
+struct HillTerm
+{
+    power_t power;
+
+    double operator()( double const x ) const
+    {
+        return equals_approx( x, 0.0 ) ? 0.0 : power( x );
+    }
+};
+
+// =================================================================================================
+//     Metric Accumulator
+// =================================================================================================
+
+/**
+ * Accumulates all metrics of a MetricSet at once.
+ *
+ * The traversals compute the distal fraction D(i) of each edge (or mass segment) only once, and
+ * hand it to add() together with the length it applies to. add() only stores the term in a block
+ * of block_size terms. Once the block is full, each metric adds it to its running sum with the
+ * loop of its kernel, which is chosen once per block, so that the loop over the terms has no
+ * dispatch in it, and a sample needs no memory beyond the block. The sums are taken in traversal
+ * order, as a separate traversal per metric would.
+ *
+ * The phylogenetic Hill number of order q (Chao et al. 2010), in units of branch length, is
+ * `T * ( sum_i (l_i / T) x_i^q )^( 1 / (1 - q) )` with `T = sum_i l_i x_i`, and the limit
+ * `T * exp( -sum_i (l_i / T) x_i log x_i )` for `q = 1`. Its kernel keeps both T and the sum.
+ * For `q = 0`, this is Faith's PD of the edges with any distal mass.
+ *
+ * For the theta grid, the logarithms `log(2*min(D,1-D))` of the spanning-tree terms are collected,
+ * and the whole curve is evaluated by theta_curve() in write_row().
+ */
+class MetricAccumulator
+{
+public:
+
+    /**
+     * Terms per block, see above.
+     */
+    static constexpr size_t block_size = 256;
+
+    explicit MetricAccumulator( MetricSet const& metrics )
+        : grid_( metrics.grid )
+    {
+        for( auto const& spec : metrics.specs ) {
+            kernels_.push_back( make_kernel_( spec ));
+        }
+    }
+
+    void add( double const length, double const x )
+    {
+        block_lengths_[ block_fill_ ] = length;
+        block_xs_[ block_fill_ ]      = x;
+        ++terms_;
+        if( ++block_fill_ == block_size ) {
+            add_block_( kernels_ );
+            block_fill_ = 0;
+        }
+
+        // only edges in the spanning tree of the sample, as in BwpdTerm
+        if( grid_.steps > 0 and not equals_approx( x, 0.0 ) and not equals_approx( x, 1.0 )) {
+            grid_log_x_.push_back( std::log( 2 * std::min( x, 1.0 - x )));
+            grid_lengths_.push_back( length );
+        }
+    }
+
+    /**
+     * Write the result into @p row, which needs to be of size MetricSet::row_size().
+     */
+    void write_row( double* row ) const
+    {
+        // the terms of the last, partial block, without consuming them
+        auto kernels = kernels_;
+        add_block_( kernels );
+        for( size_t k = 0; k < kernels.size(); ++k ) {
+            row[ k ] = value_( kernels[ k ] );
+        }
+        if( grid_.steps > 0 ) {
+            theta_curve( grid_log_x_, grid_lengths_, grid_, row + kernels_.size() );
+        }
+    }
+
+    /**
+     * Number of add() calls so far, that is, the number of edges (or mass segments) visited.
+     */
+    size_t terms() const
+    {
+        return terms_;
+    }
+
+    std::vector< double > row() const
+    {
+        std::vector< double > result( kernels_.size() + grid_.steps );
+        write_row( result.data() );
+        return result;
+    }
+
+private:
+
+    struct Kernel
+    {
+        enum Kind {
+            entropy, quadratic,
+            bwpd_zero, bwpd_linear, bwpd_sqrt, bwpd_real,
+            hill_log, hill_zero, hill_sqrt, hill_square, hill_cube, hill_fourth, hill_real
+        };
+
+        Kind   kind;
+        double exponent;
+
+        // sum of the terms, and for Hill numbers, T
+        double sum   = 0.0;
+        double total = 0.0;
+    };
+
+    static Kernel make_kernel_( MetricSpec const& spec )
+    {
+        auto const p = spec.parameter;
+        Kernel result;
+        result.kind     = Kernel::entropy;
+        result.exponent = p;
+        switch( spec.kind ) {
+            case MetricSpec::entropy:
+                break;
+            case MetricSpec::quadratic:
+                result.kind = Kernel::quadratic;
+                break;
+            case MetricSpec::faith:
+                result.kind = Kernel::bwpd_zero;
+                break;
+            case MetricSpec::bwpd:
+                result.kind = p == 0.0 ? Kernel::bwpd_zero
+                            : p == 1.0 ? Kernel::bwpd_linear
+                            : p == 0.5 ? Kernel::bwpd_sqrt
+                            : Kernel::bwpd_real;
+                break;
+            case MetricSpec::hill:
+                result.kind = p == 1.0 ? Kernel::hill_log
+                            : p == 0.0 ? Kernel::hill_zero
+                            : p == 0.5 ? Kernel::hill_sqrt
+                            : p == 2.0 ? Kernel::hill_square
+                            : p == 3.0 ? Kernel::hill_cube
+                            : p == 4.0 ? Kernel::hill_fourth
+                            : Kernel::hill_real;
+                break;
+        }
+        return result;
+    }
+
+    /**
+     * Add the first block_fill_ terms of the block to the sums of @p kernels.
+     */
+    void add_block_( std::vector< Kernel >& kernels ) const
+    {
+        for( auto& kernel : kernels ) {
+            switch( kernel.kind ) {
+                case Kernel::entropy:     sum_block_( kernel.sum, EntropyTerm() ); break;
+                case Kernel::quadratic:   sum_block_( kernel.sum, QuadraticTerm() ); break;
+                case Kernel::bwpd_zero:   sum_block_( kernel.sum, BwpdTerm< ZeroPower >() ); break;
+                case Kernel::bwpd_linear: sum_block_( kernel.sum, BwpdTerm< LinearPower >() ); break;
+                case Kernel::bwpd_sqrt:   sum_block_( kernel.sum, BwpdTerm< SqrtPower >() ); break;
+                case Kernel::bwpd_real:   sum_block_( kernel.sum, BwpdTerm< RealPower >{ RealPower{ kernel.exponent }} ); break;
+                case Kernel::hill_log:    sum_block_( kernel.sum, EntropyTerm() ); break;
+                case Kernel::hill_zero:   sum_block_( kernel.sum, HillTerm< ZeroPower >() ); break;
+                case Kernel::hill_sqrt:   sum_block_( kernel.sum, HillTerm< SqrtPower >() ); break;
+                case Kernel::hill_square: sum_block_( kernel.sum, HillTerm< IntegerPower< 2 >>() ); break;
+                case Kernel::hill_cube:   sum_block_( kernel.sum, HillTerm< IntegerPower< 3 >>() ); break;
+                case Kernel::hill_fourth: sum_block_( kernel.sum, HillTerm< IntegerPower< 4 >>() ); break;
+                case Kernel::hill_real:   sum_block_( kernel.sum, HillTerm< RealPower >{ RealPower{ kernel.exponent }} ); break;
+            }
+            if( kernel.kind >= Kernel::hill_log ) {
+                sum_block_( kernel.total, HillTerm< LinearPower >() );
+            }
+        }
+    }
+
+    template< class term_t >
+    void sum_block_( double& sum, term_t const term ) const
+    {
+        for( size_t i = 0; i < block_fill_; ++i ) {
+            sum += block_lengths_[ i ] * term( block_xs_[ i ] );
+        }
+    }
+
+    static double value_( Kernel const& kernel )
+    {
+        switch( kernel.kind ) {
+            case Kernel::entropy:
+                return -kernel.sum;
+            case Kernel::hill_log:
+                return kernel.total <= 0.0 ? 0.0 : kernel.total * std::exp( -kernel.sum / kernel.total );
+            case Kernel::hill_zero:
+            case Kernel::hill_sqrt:
+            case Kernel::hill_square:
+            case Kernel::hill_cube:
+            case Kernel::hill_fourth:
+            case Kernel::hill_real:
+                return kernel.total <= 0.0 ? 0.0
+                    : kernel.total * std::pow( kernel.sum / kernel.total, 1.0 / ( 1.0 - kernel.exponent ));
+            default:
+                return kernel.sum;
+        }
+    }
+
+    ThetaGrid grid_;
+    std::vector< Kernel > kernels_;
+    size_t terms_ = 0;
+
+    std::array< double, block_size > block_lengths_;
+    std::array< double, block_size > block_xs_;
+    size_t block_fill_ = 0;
+
+    std::vector< double > grid_log_x_;
+    std::vector< double > grid_lengths_;
+};
+
+#endif // include guard
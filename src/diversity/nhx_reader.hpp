@@ -0,0 +1,333 @@
+#ifndef DIVERSITY_NHX_READER_H_
+#define DIVERSITY_NHX_READER_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "flat_masses.hpp"
+#include "flat_tree.hpp"
+#include "gzip_input.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Fast Float Parsing
+// =================================================================================================
+
+/**
+ * Parse a decimal floating point number starting at @p ptr, and advance @p ptr behind it.
+ *
+ * Numbers with at most 19 significant digits, whose mantissa is exactly representable as a double
+ * and whose decimal exponent is within `[-22, 22]`, are computed with a single multiplication or
+ * division by an exact power of ten, which is correctly rounded (Clinger's fast path). This covers
+ * virtually all branch lengths and counts in practice. Everything else falls back to `strtod`,
+ * so @p ptr needs to point into a null terminated buffer.
+ *
+ * Throws if there is no number at @p ptr.
+ */
+inline double parse_double( char const*& ptr )
+{
+    static double const powers_of_ten[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    auto const start = ptr;
+    auto p = ptr;
+    bool const negative = ( *p == '-' );
+    if( *p == '-' or *p == '+' ) {
+        ++p;
+    }
+
+    uint64_t mantissa = 0;
+    int digits   = 0;
+    int exponent = 0;
+    bool any_digit = false;
+    while( *p >= '0' and *p <= '9' ) {
+        if( mantissa != 0 or *p != '0' ) {
+            mantissa = mantissa * 10 + static_cast< uint64_t >( *p - '0' );
+            ++digits;
+        }
+        any_digit = true;
+        ++p;
+    }
+    if( *p == '.' ) {
+        ++p;
+        while( *p >= '0' and *p <= '9' ) {
+            if( mantissa != 0 or *p != '0' ) {
+                mantissa = mantissa * 10 + static_cast< uint64_t >( *p - '0' );
+                ++digits;
+            }
+            --exponent;
+            any_digit = true;
+            ++p;
+        }
+    }
+    if( any_digit and ( *p == 'e' or *p == 'E' )) {
+        auto q = p + 1;
+        bool const exp_negative = ( *q == '-' );
+        if( *q == '-' or *q == '+' ) {
+            ++q;
+        }
+        if( *q >= '0' and *q <= '9' ) {
+            int value = 0;
+            while( *q >= '0' and *q <= '9' ) {
+                value = value < 10000 ? value * 10 + ( *q - '0' ) : value;
+                ++q;
+            }
+            exponent += exp_negative ? -value : value;
+            p = q;
+        }
+    }
+
+    if( any_digit and digits <= 19 and mantissa <= ( uint64_t( 1 ) << 53 )
+        and exponent >= -22 and exponent <= 22
+    ) {
+        auto value = static_cast< double >( mantissa );
+        value = exponent < 0 ? value / powers_of_ten[ -exponent ] : value * powers_of_ten[ exponent ];
+        ptr = p;
+        return negative ? -value : value;
+    }
+
+    // slow path for everything else, including inf and nan
+    char* end = nullptr;
+    auto const value = std::strtod( start, &end );
+    if( end == start ) {
+        throw std::runtime_error(
+            "Invalid number in Newick tree: " + std::string( start, std::min< size_t >( std::strlen( start ), 20 ))
+        );
+    }
+    ptr = end;
+    return value;
+}
+
+// =================================================================================================
+//     Scrapp Tree Reader
+// =================================================================================================
+
+/**
+ * Single pass reader for the NHX summary trees of scrapp, which writes the postorder topology and
+ * the `species_count` masses directly into a FlatTree and FlatMasses, without building any genesis
+ * tree in between.
+ *
+ * The nodes of a Newick tree are completed in postorder while reading it, so each node that is
+ * closed gets the next position. Nodes can have any number of children, so that polytomies of the
+ * summary trees are kept as they are. The species count of an edge, given as
+ * `[&&NHX:species_count=x]` with the node below it, becomes one point mass at the middle of the
+ * edge, and all masses are normalized to a total of one. Missing counts are zero, and missing
+ * branch lengths are one, as with the genesis readers. As there is no genesis tree, edge indices
+ * are the positions.
+ *
+ * All buffers are kept across files, so that one reader per thread does not allocate once it has
+ * seen the largest tree. Only the file content is released after very large files, see
+ * trim_input_buffer().
+ */
+class ScrappTreeReader
+{
+public:
+
+    void read( std::string const& file, FlatTree& tree, FlatMasses& masses )
+    {
+        read_input_file( file, buffer_ );
+        parse( buffer_.c_str(), tree, masses );
+        trim_input_buffer( buffer_ );
+    }
+
+    /**
+     * Parse a null terminated Newick/NHX string.
+     */
+    void parse( char const* text, FlatTree& tree, FlatMasses& masses )
+    {
+        tree.clear();
+        masses.offset.clear();
+        masses.points.clear();
+        masses.masses.clear();
+        frames_.clear();
+        children_.clear();
+
+        auto p = text;
+        skip_space_( p );
+        if( *p != '(' ) {
+            throw std::runtime_error( "Invalid Newick tree: does not start with '('" );
+        }
+
+        bool done = false;
+        while( not done ) {
+            skip_space_( p );
+            switch( *p ) {
+                case '(':
+                    frames_.push_back( children_.size() );
+                    ++p;
+                    break;
+                case ',':
+                    ++p;
+                    break;
+                case ')':
+                    if( frames_.empty() ) {
+                        throw std::runtime_error( "Invalid Newick tree: unbalanced parentheses" );
+                    }
+                    ++p;
+                    {
+                        auto const begin = frames_.back();
+                        frames_.pop_back();
+                        done = close_node_( p, begin, tree, masses );
+                    }
+                    break;
+                case ';':
+                case '\0':
+                    throw std::runtime_error( "Invalid Newick tree: unbalanced parentheses" );
+                default:
+                    // a leaf
+                    close_node_( p, children_.size(), tree, masses );
+            }
+        }
+        skip_space_( p );
+        if( *p != ';' ) {
+            throw std::runtime_error( "Invalid Newick tree: missing ';' at the end" );
+        }
+
+        // normalize
+        double total = 0.0;
+        for( auto const mass : masses.masses ) {
+            total += mass;
+        }
+        if( total > 0.0 ) {
+            for( auto& mass : masses.masses ) {
+                mass /= total;
+            }
+        }
+        masses.offset.push_back( masses.points.size() );
+    }
+
+private:
+
+    static void skip_space_( char const*& p )
+    {
+        while( *p == ' ' or *p == '\n' or *p == '\r' or *p == '\t' ) {
+            ++p;
+        }
+    }
+
+    /**
+     * Read the label, branch length and comments of the node whose children start at @p begin
+     * in children_, and give it the next position. Returns true for the root, which is the node
+     * that closes the outermost parenthesis.
+     */
+    bool close_node_( char const*& p, size_t const begin, FlatTree& tree, FlatMasses& masses )
+    {
+        double branch_length = 1.0;
+        double species_count = 0.0;
+        skip_name_( p );
+        while( true ) {
+            skip_space_( p );
+            if( *p == ':' ) {
+                ++p;
+                skip_space_( p );
+                branch_length = parse_double( p );
+            } else if( *p == '[' ) {
+                read_comment_( p, species_count );
+            } else {
+                break;
+            }
+        }
+
+        // the root does not have an edge of its own
+        if( frames_.empty() ) {
+            if( children_.size() - begin < 2 ) {
+                throw std::runtime_error( "Invalid Newick tree: the root needs at least two children" );
+            }
+            return true;
+        }
+
+        auto const pos = tree.size();
+        tree.position.push_back( pos );
+        tree.add( pos, branch_length, children_.begin() + begin, children_.end() );
+
+        masses.offset.push_back( masses.points.size() );
+        masses.points.push_back( branch_length / 2.0 );
+        masses.masses.push_back( species_count );
+
+        children_.resize( begin );
+        children_.push_back( pos );
+        return false;
+    }
+
+    static void skip_name_( char const*& p )
+    {
+        if( *p == '\'' ) {
+            ++p;
+            while( *p != '\0' ) {
+                if( *p == '\'' and *( p + 1 ) == '\'' ) {
+                    p += 2;
+                } else if( *p == '\'' ) {
+                    ++p;
+                    return;
+                } else {
+                    ++p;
+                }
+            }
+            throw std::runtime_error( "Invalid Newick tree: unterminated quoted name" );
+        }
+        while( *p != '\0' and std::strchr( ":,();[ \t\r\n", *p ) == nullptr ) {
+            ++p;
+        }
+    }
+
+    /**
+     * Read a comment `[...]`, and take the species count from it, if it is an NHX comment.
+     */
+    static void read_comment_( char const*& p, double& species_count )
+    {
+        auto const end = std::strchr( p, ']' );
+        if( end == nullptr ) {
+            throw std::runtime_error( "Invalid Newick tree: unterminated comment" );
+        }
+        static char const nhx[] = "[&&NHX";
+        static char const key[] = "species_count=";
+        if( std::strncmp( p, nhx, sizeof( nhx ) - 1 ) == 0 ) {
+            auto q = p + sizeof( nhx ) - 1;
+            while( q < end ) {
+                if( *q == ':' and std::strncmp( q + 1, key, sizeof( key ) - 1 ) == 0 ) {
+                    q += sizeof( key );
+                    species_count = parse_double( q );
+                } else {
+                    ++q;
+                }
+            }
+        }
+        p = end + 1;
+    }
+
+    std::string buffer_;
+
+    // start of the children of each open node in children_
+    std::vector< size_t > frames_;
+    std::vector< size_t > children_;
+};
+
+#endif // include guard
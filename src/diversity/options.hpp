@@ -0,0 +1,172 @@
+#ifndef DIVERSITY_OPTIONS_H_
+#define DIVERSITY_OPTIONS_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Command Line
+// =================================================================================================
+
+/**
+ * Minimal command line parsing for the apps.
+ *
+ * Options are of the form `--name value` for the @p valued options, or just `--name` for the
+ * @p flags. Everything else, as well as everything after a plain `--`, is a positional argument
+ * (typically the input files). Unknown options are an error.
+ */
+class CommandLine
+{
+public:
+
+    CommandLine(
+        int argc, char** argv,
+        std::vector< std::string > const& valued,
+        std::vector< std::string > const& flags = {}
+    ) {
+        bool only_positionals = false;
+        for( int i = 1; i < argc; ++i ) {
+            std::string const arg = argv[ i ];
+
+            if( only_positionals or arg.size() < 3 or arg.compare( 0, 2, "--" ) != 0 ) {
+                if( arg == "--" ) {
+                    only_positionals = true;
+                } else {
+                    positionals_.push_back( arg );
+                }
+                continue;
+            }
+
+            auto const name = arg.substr( 2 );
+            if( std::find( flags.begin(), flags.end(), name ) != flags.end() ) {
+                options_[ name ] = "";
+            } else if( std::find( valued.begin(), valued.end(), name ) != valued.end() ) {
+                if( i + 1 >= argc ) {
+                    throw std::runtime_error( "Option " + arg + " needs a value." );
+                }
+                options_[ name ] = argv[ ++i ];
+            } else {
+                throw std::runtime_error( "Unknown option " + arg );
+            }
+        }
+    }
+
+    std::vector< std::string > const& positionals() const
+    {
+        return positionals_;
+    }
+
+    bool has( std::string const& name ) const
+    {
+        return options_.count( name ) > 0;
+    }
+
+    std::string get( std::string const& name, std::string const& default_value = "" ) const
+    {
+        auto const it = options_.find( name );
+        return it == options_.end() ? default_value : it->second;
+    }
+
+    size_t get_size_t( std::string const& name, size_t const default_value ) const
+    {
+        if( not has( name ) ) {
+            return default_value;
+        }
+        auto const& value = options_.at( name );
+        char* end = nullptr;
+        auto const result = std::strtoul( value.c_str(), &end, 10 );
+        if( value.empty() or *end != '\0' or value[0] == '-' ) {
+            throw std::runtime_error( "Invalid value for option --" + name + ": " + value );
+        }
+        return result;
+    }
+
+    double get_double( std::string const& name, double const default_value ) const
+    {
+        if( not has( name ) ) {
+            return default_value;
+        }
+        auto const& value = options_.at( name );
+        char* end = nullptr;
+        auto const result = std::strtod( value.c_str(), &end );
+        if( value.empty() or *end != '\0' ) {
+            throw std::runtime_error( "Invalid value for option --" + name + ": " + value );
+        }
+        return result;
+    }
+
+    /**
+     * Comma separated list, such as `--merge a.csv,b.csv`. Empty items are an error.
+     */
+    std::vector< std::string > get_list( std::string const& name ) const
+    {
+        std::vector< std::string > result;
+        if( not has( name ) ) {
+            return result;
+        }
+        auto const& value = options_.at( name );
+        size_t begin = 0;
+        while( begin <= value.size() ) {
+            auto end = value.find( ',', begin );
+            if( end == std::string::npos ) {
+                end = value.size();
+            }
+            if( end == begin ) {
+                throw std::runtime_error( "Invalid value for option --" + name + ": " + value );
+            }
+            result.push_back( value.substr( begin, end - begin ));
+            begin = end + 1;
+        }
+        return result;
+    }
+
+    /**
+     * Comma separated list of numbers, such as `--depths 1000,5000,10000`.
+     */
+    std::vector< size_t > get_size_t_list( std::string const& name ) const
+    {
+        std::vector< size_t > result;
+        for( auto const& item : get_list( name )) {
+            char* item_end = nullptr;
+            auto const number = std::strtoul( item.c_str(), &item_end, 10 );
+            if( *item_end != '\0' or item[0] == '-' ) {
+                throw std::runtime_error( "Invalid value for option --" + name + ": " + options_.at( name ));
+            }
+            result.push_back( number );
+        }
+        return result;
+    }
+
+private:
+
+    std::vector< std::string > positionals_;
+    std::map< std::string, std::string > options_;
+};
+
+#endif // include guard
@@ -0,0 +1,356 @@
+#ifndef DIVERSITY_OUTPUT_H_
+#define DIVERSITY_OUTPUT_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "parallel.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Number Formatting
+// =================================================================================================
+
+/**
+ * Append the shortest decimal representation of @p value that reads back as the same double.
+ *
+ * C++11 has no `std::to_chars`, so we try 15, 16 and 17 significant digits, the last of which
+ * always round-trips. As `%g` drops trailing zeros, values with few digits, such as 0.25, come out
+ * as short as possible. Non-finite values are written the way R reads them.
+ */
+inline void append_double( std::string& out, double const value )
+{
+    if( value == 0.0 ) {
+        out += '0';
+        return;
+    }
+    if( not std::isfinite( value )) {
+        out += std::isnan( value ) ? "NaN" : ( value > 0.0 ? "Inf" : "-Inf" );
+        return;
+    }
+
+    char buffer[ 32 ];
+    int length = 0;
+    for( int precision = 15; precision <= 17; ++precision ) {
+        length = std::snprintf( buffer, sizeof( buffer ), "%.*g", precision, value );
+        if( std::strtod( buffer, nullptr ) == value ) {
+            break;
+        }
+    }
+    out.append( buffer, static_cast< size_t >( length ));
+}
+
+// =================================================================================================
+//     Table Format
+// =================================================================================================
+
+/**
+ * How a TableWriter lays out its rows.
+ *
+ * The wide layout has one CSV row per key (typically the sample) with one column per metric.
+ * The long layout has one row per key and metric instead, with the columns `metric` and `value`.
+ * Either layout can also be written as a binary column file, see TableWriter::finish().
+ */
+struct TableFormat
+{
+    bool long_layout = false;
+    bool binary      = false;
+};
+
+inline TableFormat parse_table_format( std::string const& layout, bool const binary )
+{
+    if( layout != "wide" and layout != "long" ) {
+        throw std::runtime_error( "Invalid layout '" + layout + "', expecting wide or long" );
+    }
+    TableFormat result;
+    result.long_layout = ( layout == "long" );
+    result.binary      = binary;
+    return result;
+}
+
+// =================================================================================================
+//     Table Writer
+// =================================================================================================
+
+/**
+ * Result table with some string key columns (such as the sample name) and some metric columns.
+ *
+ * CSV rows are formatted into a buffer that is only written once it is large, or on flush().
+ * add_rows() formats many rows in parallel, each chunk of rows into its own buffer, which are then
+ * written in order. The header is written once, before the first row.
+ *
+ * In binary mode, the rows are kept as columns until finish() writes them all at once.
+ */
+class TableWriter
+{
+public:
+
+    /**
+     * Text is written to the stream once the buffer holds this many bytes.
+     */
+    static constexpr size_t flush_size = 1 << 20;
+
+    /**
+     * Rows per parallel task of add_rows().
+     */
+    static constexpr size_t chunk_rows = 256;
+
+    TableWriter(
+        std::vector< std::string > const& key_columns,
+        std::vector< std::string > const& value_columns,
+        TableFormat const& format,
+        std::ostream& out = std::cout
+    )
+        : format_( format )
+        , key_size_( key_columns.size() )
+        , value_columns_( value_columns )
+        , out_( &out )
+    {
+        string_columns_ = key_columns;
+        if( format_.long_layout ) {
+            string_columns_.push_back( "metric" );
+            double_columns_ = { "value" };
+        } else {
+            double_columns_ = value_columns;
+        }
+
+        if( format_.binary ) {
+            string_data_.resize( string_columns_.size() );
+            double_data_.resize( double_columns_.size() );
+            return;
+        }
+        for( size_t i = 0; i < string_columns_.size() + double_columns_.size(); ++i ) {
+            buffer_ += ( i == 0 ? "" : "," );
+            buffer_ += i < string_columns_.size() ? string_columns_[ i ] : double_columns_[ i - string_columns_.size() ];
+        }
+        buffer_ += "\n";
+    }
+
+    /**
+     * Add one row, with one entry per key column in @p keys and per value column in @p values.
+     */
+    void add_row( std::string const* keys, double const* values )
+    {
+        if( format_.binary ) {
+            store_row_( keys, values );
+            return;
+        }
+        append_row_( buffer_, keys, values );
+        if( buffer_.size() >= flush_size ) {
+            write_buffer_();
+        }
+    }
+
+    void add_row( std::string const& key, std::vector< double > const& values )
+    {
+        assert( key_size_ == 1 and values.size() == value_columns_.size() );
+        add_row( &key, values.data() );
+    }
+
+    /**
+     * Add the rows `i` with keys `keys[ i * K ], ..., keys[ i * K + K - 1 ]` for K key columns,
+     * and values `rows[ i ]`, in that order.
+     */
+    void add_rows( std::vector< std::string > const& keys, std::vector< std::vector< double >> const& rows )
+    {
+        assert( keys.size() == rows.size() * key_size_ );
+        if( format_.binary ) {
+            for( size_t i = 0; i < rows.size(); ++i ) {
+                store_row_( keys.data() + i * key_size_, rows[ i ].data() );
+            }
+            return;
+        }
+
+        write_buffer_();
+        std::vector< std::string > chunks(( rows.size() + chunk_rows - 1 ) / chunk_rows );
+        parallel_for( chunks.size(), [&]( size_t const c ) {
+            for( size_t i = c * chunk_rows; i < rows.size() and i < ( c + 1 ) * chunk_rows; ++i ) {
+                assert( rows[ i ].size() == value_columns_.size() );
+                append_row_( chunks[ c ], keys.data() + i * key_size_, rows[ i ].data() );
+            }
+        });
+        for( auto const& chunk : chunks ) {
+            out_->write( chunk.data(), static_cast< std::streamsize >( chunk.size() ));
+        }
+    }
+
+    /**
+     * Write the buffered text, for example to show the rows of a long running computation.
+     */
+    void flush()
+    {
+        if( not format_.binary ) {
+            write_buffer_();
+            out_->flush();
+        }
+    }
+
+    /**
+     * Write everything that is left. In binary mode, this writes the whole column file:
+     *
+     *     "DIVCOLS\0"                         magic
+     *     int32 version, columns, rows
+     *     per column: int32 type, name\0     type 0 for strings, 1 for doubles
+     *     per column: its rows                strings each terminated by \0, or float64 values
+     *
+     * The key columns (and the `metric` column of the long layout) come first. Numbers are written
+     * in little endian, independent of the machine. This is laid out such that R can read each
+     * column with one `readBin` call, see `evaluation/read_columns.r`.
+     */
+    void finish()
+    {
+        if( not format_.binary ) {
+            flush();
+            return;
+        }
+
+        auto const rows = double_data_.empty() ? size_t( 0 ) : double_data_[0].size();
+        if( rows > static_cast< size_t >( INT32_MAX )) {
+            throw std::runtime_error( "Too many rows for the binary output." );
+        }
+        auto const write_int = [&]( size_t const value ){
+            char bytes[4];
+            store_little_endian_( bytes, static_cast< uint32_t >( value ), 4 );
+            out_->write( bytes, 4 );
+        };
+        auto const write_string = [&]( std::string const& value ){
+            out_->write( value.c_str(), static_cast< std::streamsize >( value.size() + 1 ));
+        };
+
+        out_->write( "DIVCOLS", 8 );
+        write_int( 1 );
+        write_int( string_columns_.size() + double_columns_.size() );
+        write_int( rows );
+        for( auto const& name : string_columns_ ) {
+            write_int( 0 );
+            write_string( name );
+        }
+        for( auto const& name : double_columns_ ) {
+            write_int( 1 );
+            write_string( name );
+        }
+        for( auto const& column : string_data_ ) {
+            for( auto const& value : column ) {
+                write_string( value );
+            }
+        }
+        std::vector< char > bytes;
+        for( auto const& column : double_data_ ) {
+            bytes.resize( 8 * column.size() );
+            for( size_t i = 0; i < column.size(); ++i ) {
+                uint64_t bits;
+                std::memcpy( &bits, &column[ i ], 8 );
+                store_little_endian_( bytes.data() + 8 * i, bits, 8 );
+            }
+            out_->write( bytes.data(), static_cast< std::streamsize >( bytes.size() ));
+        }
+        out_->flush();
+
+        string_data_.assign( string_columns_.size(), std::vector< std::string >() );
+        double_data_.assign( double_columns_.size(), std::vector< double >() );
+    }
+
+private:
+
+    static void store_little_endian_( char* out, uint64_t value, size_t const bytes )
+    {
+        for( size_t b = 0; b < bytes; ++b ) {
+            out[ b ] = static_cast< char >( value & 0xFF );
+            value >>= 8;
+        }
+    }
+
+    void append_row_( std::string& out, std::string const* keys, double const* values ) const
+    {
+        if( not format_.long_layout ) {
+            for( size_t k = 0; k < key_size_; ++k ) {
+                out += keys[ k ];
+                out += ',';
+            }
+            for( size_t v = 0; v < value_columns_.size(); ++v ) {
+                append_double( out, values[ v ] );
+                out += ( v + 1 < value_columns_.size() ? ',' : '\n' );
+            }
+            return;
+        }
+        for( size_t v = 0; v < value_columns_.size(); ++v ) {
+            for( size_t k = 0; k < key_size_; ++k ) {
+                out += keys[ k ];
+                out += ',';
+            }
+            out += value_columns_[ v ];
+            out += ',';
+            append_double( out, values[ v ] );
+            out += '\n';
+        }
+    }
+
+    void store_row_( std::string const* keys, double const* values )
+    {
+        if( not format_.long_layout ) {
+            for( size_t k = 0; k < key_size_; ++k ) {
+                string_data_[ k ].push_back( keys[ k ] );
+            }
+            for( size_t v = 0; v < value_columns_.size(); ++v ) {
+                double_data_[ v ].push_back( values[ v ] );
+            }
+            return;
+        }
+        for( size_t v = 0; v < value_columns_.size(); ++v ) {
+            for( size_t k = 0; k < key_size_; ++k ) {
+                string_data_[ k ].push_back( keys[ k ] );
+            }
+            string_data_[ key_size_ ].push_back( value_columns_[ v ] );
+            double_data_[0].push_back( values[ v ] );
+        }
+    }
+
+    void write_buffer_()
+    {
+        out_->write( buffer_.data(), static_cast< std::streamsize >( buffer_.size() ));
+        buffer_.clear();
+    }
+
+    TableFormat format_;
+    size_t key_size_;
+    std::vector< std::string > value_columns_;
+    std::ostream* out_;
+
+    std::vector< std::string > string_columns_;
+    std::vector< std::string > double_columns_;
+
+    std::string buffer_;
+    std::vector< std::vector< std::string >> string_data_;
+    std::vector< std::vector< double >> double_data_;
+};
+
+#endif // include guard
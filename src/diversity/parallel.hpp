@@ -0,0 +1,84 @@
+#ifndef DIVERSITY_PARALLEL_H_
+#define DIVERSITY_PARALLEL_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include <cstddef>
+#include <exception>
+#include <iostream>
+
+#if defined( GENESIS_OPENMP )
+#   include <omp.h>
+#endif
+
+// =================================================================================================
+//     Threading
+// =================================================================================================
+
+/**
+ * Set the number of threads used by all following parallel loops, including the ones in genesis.
+ */
+inline void set_num_threads( size_t const threads )
+{
+#if defined( GENESIS_OPENMP )
+    omp_set_num_threads( static_cast< int >( threads == 0 ? 1 : threads ));
+#else
+    if( threads > 1 ) {
+        std::cerr << "Warning: compiled without OpenMP, running with one thread.\n";
+    }
+#endif
+}
+
+/**
+ * Call `body( i )` for all `i` in `[0, n)`, distributed over the threads.
+ *
+ * Indices are handed out one at a time to whichever thread is idle (dynamic schedule), so that
+ * inputs of very different size still balance well. The body has to write its result to a
+ * per-index slot, so that the caller can output everything in input order afterwards.
+ * The first exception thrown by any body is rethrown after the loop.
+ */
+template< class body_t >
+void parallel_for( size_t const n, body_t body )
+{
+    std::exception_ptr error;
+
+    #pragma omp parallel for schedule( dynamic )
+    for( long i = 0; i < static_cast< long >( n ); ++i ) {
+        try {
+            body( static_cast< size_t >( i ));
+        } catch( ... ) {
+            #pragma omp critical( parallel_for_error )
+            {
+                if( not error ) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    if( error ) {
+        std::rethrow_exception( error );
+    }
+}
+
+#endif // include guard
@@ -0,0 +1,180 @@
+#ifndef DIVERSITY_PLACEMENT_FILTER_H_
+#define DIVERSITY_PLACEMENT_FILTER_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "sparse.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// =================================================================================================
+//     Placement Filter
+// =================================================================================================
+
+/**
+ * Which placements of a pquery count towards the query counts, and with which weight.
+ *
+ * The placements are ranked by like weight ratio, and the @p top_k best ones (all, if zero) with
+ * a ratio of at least @p cutoff are kept, but at least the best one. The multiplicity of the pquery
+ * is then spread over the kept placements, proportionally to their ratios.
+ *
+ * The cutoff applies to the ratios normalized per pquery, that is, relative to the sum over all of
+ * its placements, no matter whether the input was normalized already. This way, every input mode
+ * keeps the same placements.
+ *
+ * The default, top_k = 1, is the best hit: the whole multiplicity goes to the most likely
+ * placement, the first one in case of ties.
+ */
+struct PlacementFilter
+{
+    double cutoff = 0.0;
+    size_t top_k  = 1;
+
+    bool best_hit_only() const
+    {
+        return top_k == 1;
+    }
+};
+
+// =================================================================================================
+//     Weighted Counts
+// =================================================================================================
+
+/**
+ * Accumulates the query counts of the pqueries of a sample according to a PlacementFilter.
+ *
+ * The counts are summed up in a dense vector over the positions, remembering which positions were
+ * touched, so that each placement costs constant time, and the sparse result only needs to sort
+ * the touched positions. All buffers are kept across reset() calls, so that one accumulator per
+ * thread is enough.
+ */
+class WeightedCounts
+{
+public:
+
+    void reset( size_t const positions )
+    {
+        for( auto const pos : touched_ ) {
+            dense_[ pos ] = 0.0;
+            is_touched_[ pos ] = 0;
+        }
+        touched_.clear();
+        dense_.resize( positions, 0.0 );
+        is_touched_.resize( positions, 0 );
+    }
+
+    /**
+     * Add one pquery with the given @p multiplicity and its placements, given as positions and
+     * like weight ratios.
+     */
+    void add(
+        size_t const* positions,
+        double const* lwrs,
+        size_t const count,
+        double const multiplicity,
+        PlacementFilter const& filter
+    ) {
+        if( count == 0 ) {
+            return;
+        }
+
+        // best hit: first maximum, without touching the rest
+        if( filter.best_hit_only() or count == 1 ) {
+            size_t best = 0;
+            for( size_t p = 1; p < count; ++p ) {
+                if( lwrs[ p ] > lwrs[ best ] ) {
+                    best = p;
+                }
+            }
+            add_mass_( positions[ best ], multiplicity );
+            return;
+        }
+
+        // rank the placements, and keep the top k above the cutoff, but at least the best one
+        order_.resize( count );
+        for( size_t p = 0; p < count; ++p ) {
+            order_[ p ] = p;
+        }
+        auto const by_lwr = [&]( size_t a, size_t b ){
+            return lwrs[ a ] > lwrs[ b ] or ( lwrs[ a ] == lwrs[ b ] and a < b );
+        };
+        auto kept = count;
+        if( filter.top_k > 0 and filter.top_k < count ) {
+            std::nth_element( order_.begin(), order_.begin() + filter.top_k, order_.end(), by_lwr );
+            kept = filter.top_k;
+        }
+        std::sort( order_.begin(), order_.begin() + kept, by_lwr );
+
+        // the cutoff is relative to the normalized ratios
+        double total = 0.0;
+        for( size_t p = 0; p < count; ++p ) {
+            total += lwrs[ p ];
+        }
+        while( kept > 1 and lwrs[ order_[ kept - 1 ]] < filter.cutoff * total ) {
+            --kept;
+        }
+
+        double sum = 0.0;
+        for( size_t k = 0; k < kept; ++k ) {
+            sum += lwrs[ order_[ k ]];
+        }
+        for( size_t k = 0; k < kept; ++k ) {
+            auto const share = sum > 0.0 ? lwrs[ order_[ k ]] / sum : 1.0 / static_cast< double >( kept );
+            add_mass_( positions[ order_[ k ]], multiplicity * share );
+        }
+    }
+
+    /**
+     * The counts so far, sorted by position.
+     */
+    SparseMasses result() const
+    {
+        auto sorted = touched_;
+        std::sort( sorted.begin(), sorted.end() );
+        SparseMasses counts;
+        for( auto const pos : sorted ) {
+            counts.add( pos, dense_[ pos ] );
+        }
+        return counts;
+    }
+
+private:
+
+    void add_mass_( size_t const pos, double const mass )
+    {
+        if( not is_touched_[ pos ] ) {
+            is_touched_[ pos ] = 1;
+            touched_.push_back( pos );
+        }
+        dense_[ pos ] += mass;
+    }
+
+    std::vector< double > dense_;
+    std::vector< unsigned char > is_touched_;
+    std::vector< size_t > touched_;
+    std::vector< size_t > order_;
+};
+
+#endif // include guard
@@ -0,0 +1,175 @@
+#ifndef DIVERSITY_PREFETCH_H_
+#define DIVERSITY_PREFETCH_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "parallel.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// =================================================================================================
+//     Ordered Prefetcher
+// =================================================================================================
+
+/**
+ * Loads the items `0 .. count-1` with background threads, and hands them out in order.
+ *
+ * At most @p capacity items are loaded ahead of the consumer, so that memory stays bounded by
+ * that many items, no matter how many inputs there are. With several @p workers, the items are
+ * loaded in parallel, but still returned in index order by next(). With a capacity of zero, no
+ * background threads are used, and next() simply loads the item itself.
+ *
+ * An exception thrown while loading an item is rethrown by the next() call for that item.
+ */
+template< class T >
+class OrderedPrefetcher
+{
+public:
+
+    using load_function = std::function< T( size_t ) >;
+
+    OrderedPrefetcher( size_t count, size_t capacity, size_t workers, load_function load )
+        : count_( count )
+        , capacity_( capacity )
+        , load_( load )
+        , slots_( capacity )
+        , errors_( capacity )
+    {
+        if( capacity_ == 0 ) {
+            return;
+        }
+        for( size_t i = 0; i < ( workers == 0 ? 1 : workers ); ++i ) {
+            workers_.emplace_back( &OrderedPrefetcher::work, this );
+        }
+    }
+
+    ~OrderedPrefetcher()
+    {
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            stop_ = true;
+        }
+        changed_.notify_all();
+        for( auto& worker : workers_ ) {
+            worker.join();
+        }
+    }
+
+    OrderedPrefetcher( OrderedPrefetcher const& ) = delete;
+    OrderedPrefetcher& operator= ( OrderedPrefetcher const& ) = delete;
+
+    bool has_next() const
+    {
+        return next_to_consume_ < count_;
+    }
+
+    /**
+     * Return the next item in index order, waiting for it to be loaded if needed.
+     */
+    T next()
+    {
+        if( not has_next() ) {
+            throw std::out_of_range( "OrderedPrefetcher has no more items." );
+        }
+        if( capacity_ == 0 ) {
+            return load_( next_to_consume_++ );
+        }
+
+        std::unique_lock< std::mutex > lock( mutex_ );
+        auto const slot = next_to_consume_ % capacity_;
+        changed_.wait( lock, [&](){
+            return slots_[ slot ] or errors_[ slot ];
+        });
+
+        // free the slot and move on, so that a worker can start loading the next item
+        std::unique_ptr< T > item = std::move( slots_[ slot ] );
+        std::exception_ptr error = errors_[ slot ];
+        errors_[ slot ] = nullptr;
+        ++next_to_consume_;
+        lock.unlock();
+        changed_.notify_all();
+
+        if( error ) {
+            std::rethrow_exception( error );
+        }
+        return std::move( *item );
+    }
+
+private:
+
+    void work()
+    {
+        // the workers already run in parallel, so loading an item must not start a thread team of
+        // its own, such as for the blocks of a BGZF file
+        set_num_threads( 1 );
+
+        std::unique_lock< std::mutex > lock( mutex_ );
+        while( true ) {
+            changed_.wait( lock, [&](){
+                return stop_ or next_to_load_ >= count_ or next_to_load_ < next_to_consume_ + capacity_;
+            });
+            if( stop_ or next_to_load_ >= count_ ) {
+                return;
+            }
+            auto const index = next_to_load_++;
+            lock.unlock();
+
+            std::unique_ptr< T > item;
+            std::exception_ptr error;
+            try {
+                item = std::unique_ptr< T >( new T( load_( index )));
+            } catch( ... ) {
+                error = std::current_exception();
+            }
+
+            lock.lock();
+            slots_[ index % capacity_ ]  = std::move( item );
+            errors_[ index % capacity_ ] = error;
+            changed_.notify_all();
+        }
+    }
+
+    size_t const count_;
+    size_t const capacity_;
+    load_function load_;
+
+    std::vector< std::unique_ptr< T >> slots_;
+    std::vector< std::exception_ptr > errors_;
+    size_t next_to_load_    = 0;
+    size_t next_to_consume_ = 0;
+    bool stop_ = false;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::vector< std::thread > workers_;
+};
+
+#endif // include guard
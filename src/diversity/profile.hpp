@@ -0,0 +1,339 @@
+#ifndef DIVERSITY_PROFILE_H_
+#define DIVERSITY_PROFILE_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+#   include <sys/resource.h>
+#endif
+
+// =================================================================================================
+//     Process Statistics
+// =================================================================================================
+
+/**
+ * Number of allocations of the calling thread, counted by the operator new of
+ * count_allocations.hpp, if the executable includes it and is built with APPS_COUNT_ALLOCATIONS,
+ * and zero otherwise.
+ */
+inline size_t& thread_allocation_count()
+{
+    static thread_local size_t count = 0;
+    return count;
+}
+
+/**
+ * Peak resident set size of the process so far, as reported by the system (kilobytes on Linux),
+ * or zero if not available.
+ */
+inline long peak_rss()
+{
+#if defined( __unix__ ) || defined( __APPLE__ )
+    struct rusage usage;
+    if( getrusage( RUSAGE_SELF, &usage ) == 0 ) {
+        return usage.ru_maxrss;
+    }
+#endif
+    return 0;
+}
+
+// =================================================================================================
+//     Profile
+// =================================================================================================
+
+/**
+ * Time, calls and allocations of all scopes of one phase.
+ */
+struct ProfilePhase
+{
+    double seconds     = 0.0;
+    size_t calls       = 0;
+    size_t allocations = 0;
+};
+
+/**
+ * Phases and counters, either of the whole run, or of one sample.
+ */
+struct ProfileRecord
+{
+    std::map< std::string, ProfilePhase > phases;
+    std::map< std::string, double > counters;
+    long peak_rss = 0;
+};
+
+/**
+ * Per-phase and per-sample breakdown of a run, written by `--profile out.json`.
+ *
+ * Phases are timed with ProfileTimer, and counters such as bytes read or edges visited are added
+ * with count(). Everything is attributed to the whole run, and additionally to the sample that the
+ * calling thread is working on, as set by ProfileSample. Unless enable() was called, the timers
+ * and counters only check a flag, so that normal runs do not pay for the instrumentation.
+ */
+class Profile
+{
+public:
+
+    static Profile& global()
+    {
+        static Profile profile;
+        return profile;
+    }
+
+    void enable()
+    {
+        enabled_ = true;
+        start_   = std::chrono::steady_clock::now();
+    }
+
+    bool enabled() const
+    {
+        return enabled_;
+    }
+
+    void add_phase( std::string const& phase, double const seconds, size_t const allocations )
+    {
+        auto const rss = peak_rss();
+        std::lock_guard< std::mutex > lock( mutex_ );
+        for( auto record : records_() ) {
+            auto& entry = record->phases[ phase ];
+            entry.seconds     += seconds;
+            entry.calls       += 1;
+            entry.allocations += allocations;
+            record->peak_rss   = std::max( record->peak_rss, rss );
+        }
+    }
+
+    void count( std::string const& counter, double const value )
+    {
+        if( not enabled_ ) {
+            return;
+        }
+
+        // the bookkeeping does not count towards the allocations of the enclosing phase
+        auto const allocations = thread_allocation_count();
+        {
+            std::lock_guard< std::mutex > lock( mutex_ );
+            for( auto record : records_() ) {
+                record->counters[ counter ] += value;
+            }
+        }
+        thread_allocation_count() = allocations;
+    }
+
+    /**
+     * Name of the sample that the calling thread is working on, see ProfileSample.
+     */
+    static std::string& current_sample()
+    {
+        static thread_local std::string name;
+        return name;
+    }
+
+    void write( std::string const& file ) const
+    {
+        std::ofstream out( file );
+        if( not out ) {
+            throw std::runtime_error( "Cannot write profile to " + file );
+        }
+
+        std::lock_guard< std::mutex > lock( mutex_ );
+        auto const wall = std::chrono::duration< double >( std::chrono::steady_clock::now() - start_ );
+        out << "{\n  \"wall_seconds\": " << wall.count() << ",\n";
+        out << "  \"peak_rss_kb\": " << peak_rss() << ",\n";
+        write_record_( out, total_, "  " );
+        out << ",\n  \"samples\": [";
+        for( size_t i = 0; i < sample_order_.size(); ++i ) {
+            out << ( i > 0 ? "," : "" ) << "\n    {\n      \"name\": \"" << json_escape_( sample_order_[ i ] ) << "\",\n";
+            auto const& record = samples_.at( sample_order_[ i ] );
+            out << "      \"peak_rss_kb\": " << record.peak_rss << ",\n";
+            write_record_( out, record, "      " );
+            out << "\n    }";
+        }
+        out << "\n  ]\n}\n";
+    }
+
+private:
+
+    Profile() = default;
+
+    /**
+     * The records to attribute to: the whole run, and the current sample, if any.
+     * Needs the mutex to be locked.
+     */
+    std::vector< ProfileRecord* > records_()
+    {
+        std::vector< ProfileRecord* > result = { &total_ };
+        auto const& sample = current_sample();
+        if( not sample.empty() ) {
+            if( samples_.count( sample ) == 0 ) {
+                sample_order_.push_back( sample );
+            }
+            result.push_back( &samples_[ sample ] );
+        }
+        return result;
+    }
+
+    /**
+     * The string as the content of a JSON string, as sample names are file names, which can
+     * contain quotes, backslashes or control characters.
+     */
+    static std::string json_escape_( std::string const& value )
+    {
+        std::string result;
+        for( auto const c : value ) {
+            switch( c ) {
+                case '"':  result += "\\\""; break;
+                case '\\': result += "\\\\"; break;
+                case '\n': result += "\\n"; break;
+                case '\t': result += "\\t"; break;
+                default:
+                    if( static_cast< unsigned char >( c ) < 0x20 ) {
+                        char escaped[8];
+                        std::snprintf( escaped, sizeof( escaped ), "\\u%04x", static_cast< unsigned >( c ));
+                        result += escaped;
+                    } else {
+                        result += c;
+                    }
+            }
+        }
+        return result;
+    }
+
+    static void write_record_( std::ostream& out, ProfileRecord const& record, std::string const& indent )
+    {
+        out << indent << "\"phases\": {";
+        bool first = true;
+        for( auto const& phase : record.phases ) {
+            out << ( first ? "" : "," ) << "\n" << indent << "  \"" << json_escape_( phase.first ) << "\": { "
+                << "\"seconds\": " << phase.second.seconds << ", "
+                << "\"calls\": " << phase.second.calls << ", "
+                << "\"allocations\": " << phase.second.allocations << " }";
+            first = false;
+        }
+        out << "\n" << indent << "},\n" << indent << "\"counters\": {";
+        first = true;
+        for( auto const& counter : record.counters ) {
+            out << ( first ? "" : "," ) << "\n" << indent << "  \"" << json_escape_( counter.first ) << "\": "
+                << counter.second;
+            first = false;
+        }
+        out << "\n" << indent << "}";
+    }
+
+    bool enabled_ = false;
+    std::chrono::steady_clock::time_point start_;
+
+    mutable std::mutex mutex_;
+    ProfileRecord total_;
+    std::vector< std::string > sample_order_;
+    std::map< std::string, ProfileRecord > samples_;
+};
+
+// =================================================================================================
+//     Scoped Helpers
+// =================================================================================================
+
+/**
+ * Times the enclosing scope as one call of the given phase, including the allocations that the
+ * calling thread makes in it.
+ */
+class ProfileTimer
+{
+public:
+
+    explicit ProfileTimer( char const* phase )
+        : phase_( Profile::global().enabled() ? phase : nullptr )
+    {
+        if( phase_ ) {
+            allocations_ = thread_allocation_count();
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~ProfileTimer()
+    {
+        if( phase_ ) {
+            auto const seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start_ );
+            Profile::global().add_phase( phase_, seconds.count(), thread_allocation_count() - allocations_ );
+        }
+    }
+
+    ProfileTimer( ProfileTimer const& ) = delete;
+    ProfileTimer& operator=( ProfileTimer const& ) = delete;
+
+private:
+
+    char const* phase_;
+    size_t allocations_ = 0;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * Attributes the phases and counters of the calling thread to the given sample, until the end
+ * of the enclosing scope.
+ */
+class ProfileSample
+{
+public:
+
+    explicit ProfileSample( std::string const& name )
+    {
+        if( Profile::global().enabled() ) {
+            auto const allocations = thread_allocation_count();
+            Profile::current_sample() = name;
+            thread_allocation_count() = allocations;
+        }
+    }
+
+    ~ProfileSample()
+    {
+        if( Profile::global().enabled() ) {
+            Profile::current_sample().clear();
+        }
+    }
+
+    ProfileSample( ProfileSample const& ) = delete;
+    ProfileSample& operator=( ProfileSample const& ) = delete;
+};
+
+/**
+ * Size of a file in bytes, for the bytes read counters.
+ */
+inline double input_file_size( std::string const& file )
+{
+    std::ifstream in( file, std::ios::binary | std::ios::ate );
+    return in ? static_cast< double >( in.tellg() ) : 0.0;
+}
+
+#endif // include guard
@@ -0,0 +1,232 @@
+#ifndef DIVERSITY_RESAMPLE_H_
+#define DIVERSITY_RESAMPLE_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "flat_tree.hpp"
+#include "metrics.hpp"
+#include "sparse.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// =================================================================================================
+//     Resampling Counts
+// =================================================================================================
+
+/**
+ * The integer query counts of a sample, prepared once for drawing many replicates from them.
+ *
+ * The categories are the occupied positions of the sample, in postorder, plus one last category
+ * for the queries without any placement, which count towards the total, but not towards any edge.
+ */
+class CountResampler
+{
+public:
+
+    CountResampler( SparseMasses const& counts, double const total )
+    {
+        size_t placed = 0;
+        for( size_t i = 0; i < counts.size(); ++i ) {
+            auto const count = static_cast< size_t >( std::llround( counts.masses[ i ] ));
+            positions_.push_back( counts.positions[ i ] );
+            counts_.push_back( count );
+            placed += count;
+        }
+        auto const all = static_cast< size_t >( std::llround( total ));
+        if( all < placed ) {
+            throw std::runtime_error( "Query counts of a sample exceed its total." );
+        }
+        counts_.push_back( all - placed );
+        total_ = all;
+    }
+
+    size_t total() const
+    {
+        return total_;
+    }
+
+    /**
+     * Bootstrap replicate: @p depth queries drawn with replacement, that is, multinomial counts.
+     *
+     * We draw the categories one after the other, each from a binomial distribution conditioned on
+     * the queries that are not assigned yet. This takes one binomial draw per occupied edge,
+     * instead of one draw per query.
+     */
+    template< class rng_t >
+    void bootstrap( size_t const depth, rng_t& rng, SparseMasses& result ) const
+    {
+        result.positions.clear();
+        result.masses.clear();
+
+        auto remaining_n    = depth;
+        auto remaining_mass = total_;
+        for( size_t i = 0; i + 1 < counts_.size() and remaining_n > 0; ++i ) {
+            if( counts_[ i ] == 0 ) {
+                continue;
+            }
+            auto const p = static_cast< double >( counts_[ i ] ) / static_cast< double >( remaining_mass );
+            size_t drawn = remaining_n;
+            if( p < 1.0 ) {
+                std::binomial_distribution< size_t > binomial( remaining_n, p );
+                drawn = binomial( rng );
+            }
+            if( drawn > 0 ) {
+                result.add( positions_[ i ], static_cast< double >( drawn ));
+            }
+            remaining_n    -= drawn;
+            remaining_mass -= counts_[ i ];
+        }
+    }
+
+    /**
+     * Rarefied replicate: @p depth queries drawn without replacement, with @p depth not larger than
+     * total(). @p labels is a per-thread scratch array, see make_labels().
+     *
+     * We use a partial Fisher-Yates shuffle, which only touches @p depth entries. The labels do not
+     * need to be reset in between replicates, as any permutation of them is a valid input.
+     */
+    template< class rng_t >
+    void rarefy(
+        size_t const depth,
+        rng_t& rng,
+        std::vector< uint32_t >& labels,
+        std::vector< size_t >& drawn,
+        SparseMasses& result
+    ) const {
+        assert( depth <= labels.size() );
+        drawn.assign( counts_.size(), 0 );
+        for( size_t i = 0; i < depth; ++i ) {
+            std::uniform_int_distribution< size_t > pick( i, labels.size() - 1 );
+            std::swap( labels[ i ], labels[ pick( rng ) ] );
+            ++drawn[ labels[ i ] ];
+        }
+
+        result.positions.clear();
+        result.masses.clear();
+        for( size_t i = 0; i + 1 < counts_.size(); ++i ) {
+            if( drawn[ i ] > 0 ) {
+                result.add( positions_[ i ], static_cast< double >( drawn[ i ] ));
+            }
+        }
+    }
+
+    /**
+     * One label (category index) per query, as input for rarefy().
+     */
+    std::vector< uint32_t > make_labels() const
+    {
+        std::vector< uint32_t > labels;
+        labels.reserve( total_ );
+        for( size_t i = 0; i < counts_.size(); ++i ) {
+            labels.insert( labels.end(), counts_[ i ], static_cast< uint32_t >( i ));
+        }
+        return labels;
+    }
+
+private:
+
+    std::vector< size_t > positions_;
+    std::vector< size_t > counts_;
+    size_t total_ = 0;
+};
+
+// =================================================================================================
+//     Replicate Summary
+// =================================================================================================
+
+/**
+ * Linearly interpolated percentile of the sorted @p values, with @p q in `[0, 1]`.
+ */
+inline double sorted_percentile( std::vector< double > const& values, double const q )
+{
+    assert( not values.empty() );
+    auto const pos   = q * static_cast< double >( values.size() - 1 );
+    auto const lower = static_cast< size_t >( std::floor( pos ));
+    auto const upper = std::min( lower + 1, values.size() - 1 );
+    return values[ lower ] + ( pos - static_cast< double >( lower )) * ( values[ upper ] - values[ lower ] );
+}
+
+/**
+ * Evaluate @p replicates resampled count sets of a sample at the given @p depth, and summarize
+ * every metric of the row by its mean and the central @p confidence percentile interval.
+ * If @p rarefy is false, replicates are bootstrapped, otherwise rarefied.
+ *
+ * The result has three values per metric: mean, lower and upper bound. All replicates reuse the
+ * scratch buffers and the SparseTree of the reference, and only go through the sparse BWPD.
+ */
+inline std::vector< double > resampled_row(
+    SparseTree const& sparse_tree,
+    CountResampler const& resampler,
+    MetricSet const& metrics,
+    size_t const depth,
+    bool const rarefy,
+    size_t const replicates,
+    double const confidence,
+    std::mt19937_64& rng
+) {
+    auto const row_size = metrics.row_size();
+    std::vector< double > values( replicates * row_size );
+
+    std::vector< uint32_t > labels;
+    if( rarefy ) {
+        labels = resampler.make_labels();
+    }
+    std::vector< size_t > drawn;
+    SparseMasses replicate;
+
+    for( size_t r = 0; r < replicates; ++r ) {
+        if( rarefy ) {
+            resampler.rarefy( depth, rng, labels, drawn, replicate );
+        } else {
+            resampler.bootstrap( depth, rng, replicate );
+        }
+        MetricAccumulator accumulator( metrics );
+        BWPD( sparse_tree, replicate, static_cast< double >( depth ), accumulator );
+        accumulator.write_row( &values[ r * row_size ] );
+    }
+
+    std::vector< double > result;
+    std::vector< double > column( replicates );
+    for( size_t m = 0; m < row_size; ++m ) {
+        double sum = 0.0;
+        for( size_t r = 0; r < replicates; ++r ) {
+            column[ r ] = values[ r * row_size + m ];
+            sum += column[ r ];
+        }
+        std::sort( column.begin(), column.end() );
+        result.push_back( sum / static_cast< double >( replicates ));
+        result.push_back( sorted_percentile( column, ( 1.0 - confidence ) / 2.0 ));
+        result.push_back( sorted_percentile( column, ( 1.0 + confidence ) / 2.0 ));
+    }
+    return result;
+}
+
+#endif // include guard
@@ -0,0 +1,331 @@
+#ifndef DIVERSITY_SERVER_H_
+#define DIVERSITY_SERVER_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "parallel.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+#   include <csignal>
+#   include <fcntl.h>
+#   include <poll.h>
+#   include <sys/socket.h>
+#   include <sys/un.h>
+#   include <unistd.h>
+#endif
+
+// =================================================================================================
+//     Line Server
+// =================================================================================================
+
+/**
+ * A server for a simple line protocol: every request is one line, and gets exactly one line as
+ * reply, in the order of the requests of each client. Requests that throw are answered with
+ * `error <message>`. Two requests are handled by the server itself: `quit` closes the connection
+ * of the client, and `shutdown` stops the server after the pending requests.
+ *
+ * Clients are either stdin/stdout, or the connections to a Unix domain socket. A single thread
+ * waits for all of them, and whenever some requests are complete, evaluates them as one batch
+ * with parallel_for(), so that requests from many clients share the threads.
+ *
+ * Replies are queued per client, and written whenever the client can take them, so that a client
+ * that reads slowly does not hold up the others. Socket clients are non-blocking for that. Once a
+ * client has more than pending_limit bytes of replies queued, no further requests are read from
+ * it until it has caught up.
+ */
+class LineServer
+{
+public:
+
+    using Handler = std::function< std::string( std::string const& request ) >;
+
+    /**
+     * Queued reply bytes of a client, beyond which its requests are not read for now.
+     */
+    static constexpr size_t pending_limit = 1 << 20;
+
+    explicit LineServer( Handler handler )
+        : handler_( std::move( handler ))
+    {}
+
+    /**
+     * Serve requests from stdin until it ends, or until `shutdown`.
+     */
+    void serve_stdio()
+    {
+#if defined( __unix__ ) || defined( __APPLE__ )
+        std::vector< Connection > connections( 1 );
+        connections[0].in  = STDIN_FILENO;
+        connections[0].out = STDOUT_FILENO;
+        serve_( -1, connections );
+#else
+        throw std::runtime_error( "The server mode is only available on Unix systems." );
+#endif
+    }
+
+    /**
+     * Serve requests from clients connecting to a Unix domain socket at @p path until `shutdown`.
+     * An existing file at @p path is replaced, and removed again at the end.
+     */
+    void serve_socket( std::string const& path )
+    {
+#if defined( __unix__ ) || defined( __APPLE__ )
+        sockaddr_un address;
+        std::memset( &address, 0, sizeof( address ));
+        address.sun_family = AF_UNIX;
+        if( path.size() >= sizeof( address.sun_path )) {
+            throw std::runtime_error( "Socket path too long: " + path );
+        }
+        std::strcpy( address.sun_path, path.c_str() );
+
+        auto const listener = ::socket( AF_UNIX, SOCK_STREAM, 0 );
+        ::unlink( path.c_str() );
+        if( listener < 0
+            or ::bind( listener, reinterpret_cast< sockaddr* >( &address ), sizeof( address )) != 0
+            or ::listen( listener, SOMAXCONN ) != 0
+        ) {
+            throw std::runtime_error( "Cannot listen on socket " + path + ": " + std::strerror( errno ));
+        }
+
+        std::vector< Connection > connections;
+        try {
+            serve_( listener, connections );
+        } catch( ... ) {
+            ::close( listener );
+            ::unlink( path.c_str() );
+            throw;
+        }
+        ::close( listener );
+        ::unlink( path.c_str() );
+#else
+        (void) path;
+        throw std::runtime_error( "The server mode is only available on Unix systems." );
+#endif
+    }
+
+private:
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+
+    struct Connection
+    {
+        int in  = -1;
+        int out = -1;
+        std::string buffer;
+        std::string pending;
+
+        // no more requests, but the pending replies are still written
+        bool closed = false;
+
+        // the client is gone, nothing is written anymore
+        bool broken = false;
+    };
+
+    void serve_( int const listener, std::vector< Connection >& connections )
+    {
+        // clients that disconnect early must not terminate the server
+        std::signal( SIGPIPE, SIG_IGN );
+
+        // per connection, the index of its input and output in fds, if it is polled for them
+        auto const none = static_cast< size_t >( -1 );
+        std::vector< pollfd > fds;
+        std::vector< std::pair< size_t, size_t >> slots;
+        std::vector< std::pair< size_t, std::string >> batch;
+        std::vector< std::string > replies;
+        bool running = true;
+
+        // after a shutdown, the loop goes on until the replies to the earlier requests are written
+        while(( running and listener >= 0 ) or not connections.empty() ) {
+            auto const listening = running and listener >= 0;
+            fds.clear();
+            slots.clear();
+            if( listening ) {
+                fds.push_back( pollfd{ listener, POLLIN, 0 });
+            }
+            for( auto const& connection : connections ) {
+                slots.emplace_back( none, none );
+                if( not connection.closed and connection.pending.size() < pending_limit ) {
+                    slots.back().first = fds.size();
+                    fds.push_back( pollfd{ connection.in, POLLIN, 0 });
+                }
+                if( not connection.pending.empty() ) {
+                    slots.back().second = fds.size();
+                    fds.push_back( pollfd{ connection.out, POLLOUT, 0 });
+                }
+            }
+            if( ::poll( fds.data(), fds.size(), -1 ) < 0 ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                throw std::runtime_error( std::string( "Server poll failed: " ) + std::strerror( errno ));
+            }
+
+            // write what the clients can take, and collect their complete request lines
+            batch.clear();
+            for( size_t c = 0; c < connections.size(); ++c ) {
+                if( slots[ c ].second != none and fds[ slots[ c ].second ].revents != 0 ) {
+                    write_pending_( connections[ c ] );
+                }
+                if( slots[ c ].first != none and fds[ slots[ c ].first ].revents != 0 ) {
+                    running = read_requests_( connections[ c ], c, batch ) and running;
+                }
+            }
+            if( not running ) {
+                for( auto& connection : connections ) {
+                    connection.closed = true;
+                }
+            }
+
+            replies.assign( batch.size(), std::string() );
+            parallel_for( batch.size(), [&]( size_t const b ) {
+                try {
+                    replies[ b ] = handler_( batch[ b ].second );
+                } catch( std::exception const& e ) {
+                    replies[ b ] = std::string( "error " ) + e.what();
+                }
+                for( auto& c : replies[ b ] ) {
+                    c = ( c == '\n' ? ' ' : c );
+                }
+                replies[ b ] += '\n';
+            });
+            for( size_t b = 0; b < batch.size(); ++b ) {
+                auto& connection = connections[ batch[ b ].first ];
+                if( not connection.broken ) {
+                    connection.pending += replies[ b ];
+                }
+            }
+
+            // drop clients that are gone or done, and accept new ones
+            for( size_t c = connections.size(); c > 0; --c ) {
+                auto const& connection = connections[ c - 1 ];
+                if( connection.broken or ( connection.closed and connection.pending.empty() )) {
+                    if( connection.in != STDIN_FILENO ) {
+                        ::close( connection.in );
+                    }
+                    connections.erase( connections.begin() + ( c - 1 ));
+                }
+            }
+            if( running and listening and ( fds[0].revents & POLLIN )) {
+                auto const client = ::accept( listener, nullptr, nullptr );
+                if( client >= 0 ) {
+                    set_non_blocking_( client );
+                    connections.emplace_back();
+                    connections.back().in  = client;
+                    connections.back().out = client;
+                }
+            }
+        }
+    }
+
+    /**
+     * Read what is available from the client, and append its complete lines to @p batch.
+     * Returns false if the client asked to shut down the server.
+     */
+    static bool read_requests_(
+        Connection& connection, size_t const index, std::vector< std::pair< size_t, std::string >>& batch
+    ) {
+        char chunk[ 1 << 16 ];
+        auto const got = ::read( connection.in, chunk, sizeof( chunk ));
+        if( got < 0 and ( errno == EINTR or errno == EAGAIN or errno == EWOULDBLOCK )) {
+            return true;
+        }
+        if( got <= 0 ) {
+            // a last request without a line break
+            connection.closed = true;
+            connection.buffer += '\n';
+        } else {
+            connection.buffer.append( chunk, static_cast< size_t >( got ));
+        }
+
+        bool running = true;
+        size_t begin = 0;
+        size_t end = 0;
+        bool quit = false;
+        while( not quit and ( end = connection.buffer.find( '\n', begin )) != std::string::npos ) {
+            auto line = connection.buffer.substr( begin, end - begin );
+            begin = end + 1;
+            if( not line.empty() and line.back() == '\r' ) {
+                line.pop_back();
+            }
+            if( line == "quit" or line == "shutdown" ) {
+                connection.closed = true;
+                quit = true;
+                running = ( line != "shutdown" );
+            } else if( not line.empty() ) {
+                batch.emplace_back( index, std::move( line ));
+            }
+        }
+        connection.buffer.erase( 0, begin );
+        return running;
+    }
+
+    /**
+     * Write as much of the pending replies as the client takes without blocking. On a blocking
+     * output, such as stdout, that is all of them.
+     */
+    static void write_pending_( Connection& connection )
+    {
+        auto& data = connection.pending;
+        size_t written = 0;
+        while( written < data.size() ) {
+            auto const result = ::write( connection.out, data.data() + written, data.size() - written );
+            if( result < 0 and errno == EINTR ) {
+                continue;
+            }
+            if( result < 0 and ( errno == EAGAIN or errno == EWOULDBLOCK )) {
+                break;
+            }
+            if( result <= 0 ) {
+                // the client is gone, its remaining replies are dropped
+                connection.broken = true;
+                data.clear();
+                return;
+            }
+            written += static_cast< size_t >( result );
+        }
+        data.erase( 0, written );
+    }
+
+    static void set_non_blocking_( int const fd )
+    {
+        auto const flags = ::fcntl( fd, F_GETFL, 0 );
+        if( flags >= 0 ) {
+            ::fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+        }
+    }
+
+#endif
+
+    Handler handler_;
+};
+
+#endif // include guard
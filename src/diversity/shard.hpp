@@ -0,0 +1,204 @@
+#ifndef DIVERSITY_SHARD_H_
+#define DIVERSITY_SHARD_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "profile.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Shard Selection
+// =================================================================================================
+
+/**
+ * Shard `index` of `count`, given as `--shard i/N` with `0 <= i < N`.
+ */
+struct ShardSpec
+{
+    size_t index = 0;
+    size_t count = 1;
+};
+
+inline ShardSpec parse_shard( std::string const& spec )
+{
+    auto const slash = spec.find( '/' );
+    ShardSpec result;
+    char* end = nullptr;
+    bool valid = ( slash != std::string::npos and slash > 0 and spec[0] != '-' and spec[ slash + 1 ] != '-' );
+    if( valid ) {
+        result.index = std::strtoul( spec.c_str(), &end, 10 );
+        valid = ( end == spec.c_str() + slash );
+        result.count = std::strtoul( spec.c_str() + slash + 1, &end, 10 );
+        valid = valid and *end == '\0' and end != spec.c_str() + slash + 1;
+    }
+    if( not valid or result.index >= result.count ) {
+        throw std::runtime_error( "Invalid shard '" + spec + "', expecting i/N with 0 <= i < N" );
+    }
+    return result;
+}
+
+/**
+ * Assign the input files to @p count shards, balanced by file size: the largest remaining file
+ * goes to the shard with the smallest total so far. Ties are broken by input order and shard
+ * index, so that every process computes the same assignment from the same files.
+ */
+inline std::vector< size_t > shard_assignment( std::vector< std::string > const& files, size_t const count )
+{
+    std::vector< double > sizes;
+    for( auto const& file : files ) {
+        sizes.push_back( input_file_size( file ));
+    }
+    std::vector< size_t > order( files.size() );
+    std::iota( order.begin(), order.end(), 0 );
+    std::stable_sort( order.begin(), order.end(), [&]( size_t a, size_t b ){
+        return sizes[ a ] > sizes[ b ];
+    });
+
+    std::vector< size_t > result( files.size() );
+    std::vector< double > totals( count, 0.0 );
+    for( auto const i : order ) {
+        auto const shard = static_cast< size_t >( std::min_element( totals.begin(), totals.end() ) - totals.begin() );
+        result[ i ] = shard;
+        totals[ shard ] += sizes[ i ];
+    }
+    return result;
+}
+
+/**
+ * The files of one shard, in input order.
+ */
+inline std::vector< std::string > shard_files( std::vector< std::string > const& files, ShardSpec const& shard )
+{
+    auto const assignment = shard_assignment( files, shard.count );
+    std::vector< std::string > result;
+    for( size_t i = 0; i < files.size(); ++i ) {
+        if( assignment[ i ] == shard.index ) {
+            result.push_back( files[ i ] );
+        }
+    }
+    return result;
+}
+
+// =================================================================================================
+//     Merging Shard Outputs
+// =================================================================================================
+
+/**
+ * Merge the CSV outputs of the shards of a run into one, as if all inputs had been processed by
+ * a single process.
+ *
+ * The outputs consist of one or more tables, each starting with a header line `sample,...`. Within
+ * each table, the rows of a sample are consecutive and start with its name. The tables are merged
+ * one by one: their headers need to be identical in all shards, and are written once. The rows are
+ * then written per sample in the order of @p sample_names, which are the names of all inputs of
+ * the run. Samples that are duplicated or unknown are an error, and so are missing ones, unless
+ * @p allow_missing is set for modes that skip some samples on purpose, such as rarefaction below
+ * the depth of a sample, or clade profiles of samples without mass.
+ */
+inline void merge_shard_outputs(
+    std::vector< std::string > const& shard_outputs,
+    std::vector< std::string > const& sample_names,
+    bool const allow_missing,
+    std::ostream& out
+) {
+    std::map< std::string, size_t > sample_index;
+    for( size_t i = 0; i < sample_names.size(); ++i ) {
+        if( not sample_index.emplace( sample_names[ i ], i ).second ) {
+            throw std::runtime_error( "Cannot merge, as the sample name " + sample_names[ i ] + " is not unique." );
+        }
+    }
+
+    // per table, its header and the rows of each sample
+    std::vector< std::string > headers;
+    std::vector< std::vector< std::string >> tables;
+    std::vector< std::vector< bool >> seen;
+
+    for( auto const& output : shard_outputs ) {
+        std::ifstream in( output );
+        if( not in ) {
+            throw std::runtime_error( "Cannot read shard output " + output );
+        }
+        size_t table = 0;
+        bool in_table = false;
+        std::string line;
+        std::string previous;
+        while( std::getline( in, line )) {
+            if( line.empty() ) {
+                continue;
+            }
+            if( line.compare( 0, 7, "sample," ) == 0 ) {
+                table += in_table ? 1 : 0;
+                in_table = true;
+                previous.clear();
+                if( table == headers.size() ) {
+                    headers.push_back( line );
+                    tables.emplace_back( sample_names.size() );
+                    seen.emplace_back( sample_names.size(), false );
+                } else if( headers[ table ] != line ) {
+                    throw std::runtime_error( "Cannot merge " + output + ", as its header differs from the other shards." );
+                }
+                continue;
+            }
+            if( not in_table ) {
+                throw std::runtime_error( "Cannot merge " + output + ", as it does not start with a header." );
+            }
+
+            auto const name = line.substr( 0, line.find( ',' ));
+            auto const it = sample_index.find( name );
+            if( it == sample_index.end() ) {
+                throw std::runtime_error( "Sample " + name + " in " + output + " is not one of the inputs." );
+            }
+            if( name != previous and seen[ table ][ it->second ] ) {
+                throw std::runtime_error( "Sample " + name + " is in more than one shard output." );
+            }
+            seen[ table ][ it->second ] = true;
+            previous = name;
+            tables[ table ][ it->second ] += line + "\n";
+        }
+    }
+
+    for( size_t t = 0; t < tables.size() and not allow_missing; ++t ) {
+        for( size_t i = 0; i < sample_names.size(); ++i ) {
+            if( not seen[ t ][ i ] ) {
+                throw std::runtime_error( "Sample " + sample_names[ i ] + " is missing from the shard outputs." );
+            }
+        }
+    }
+    for( size_t t = 0; t < tables.size(); ++t ) {
+        out << headers[ t ] << "\n";
+        for( auto const& rows : tables[ t ] ) {
+            out << rows;
+        }
+    }
+}
+
+#endif // include guard
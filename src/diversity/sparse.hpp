@@ -0,0 +1,390 @@
+#ifndef DIVERSITY_SPARSE_H_
+#define DIVERSITY_SPARSE_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "bwpd.hpp"
+#include "flat_tree.hpp"
+#include "functions.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+// =================================================================================================
+//     Sparse Masses
+// =================================================================================================
+
+/**
+ * Masses of a sample that only touches few edges: a list of FlatTree positions and their masses.
+ *
+ * Entries can be appended in any order, with repeated positions. normalize_sparse_masses() then
+ * sorts them by position and merges repeated positions.
+ */
+struct SparseMasses
+{
+    std::vector< size_t > positions;
+    std::vector< double > masses;
+
+    void add( size_t const position, double const mass )
+    {
+        positions.push_back( position );
+        masses.push_back( mass );
+    }
+
+    size_t size() const
+    {
+        return positions.size();
+    }
+};
+
+/**
+ * Sort the entries by position, and sum up the masses of repeated positions, in the order in
+ * which they were added.
+ */
+inline void normalize_sparse_masses( SparseMasses& sparse )
+{
+    std::vector< size_t > order( sparse.size() );
+    std::iota( order.begin(), order.end(), 0 );
+    std::stable_sort( order.begin(), order.end(), [&]( size_t a, size_t b ){
+        return sparse.positions[ a ] < sparse.positions[ b ];
+    });
+
+    SparseMasses result;
+    for( auto const i : order ) {
+        if( not result.positions.empty() and result.positions.back() == sparse.positions[ i ] ) {
+            result.masses.back() += sparse.masses[ i ];
+        } else {
+            result.add( sparse.positions[ i ], sparse.masses[ i ] );
+        }
+    }
+    sparse = std::move( result );
+}
+
+inline std::vector< double > to_dense( SparseMasses const& sparse, size_t const size )
+{
+    std::vector< double > result( size, 0.0 );
+    for( size_t i = 0; i < sparse.size(); ++i ) {
+        result[ sparse.positions[ i ]] += sparse.masses[ i ];
+    }
+    return result;
+}
+
+/**
+ * Read-only view of sparse masses that are sorted by position, for arrays that are not owned by a
+ * SparseMasses, such as those of a memory mapped cache file. Unlike in a normalized SparseMasses,
+ * positions can be repeated, and their masses are summed up by the sparse BWPD().
+ */
+template< class position_t >
+struct SparseView
+{
+    size_t size;
+    position_t const* positions;
+    double const* masses;
+};
+
+inline SparseView< size_t > sparse_view( SparseMasses const& sparse )
+{
+    return { sparse.size(), sparse.positions.data(), sparse.masses.data() };
+}
+
+template< class position_t >
+std::vector< double > to_dense( SparseView< position_t > const& sparse, size_t const size )
+{
+    std::vector< double > result( size, 0.0 );
+    for( size_t i = 0; i < sparse.size; ++i ) {
+        result[ sparse.positions[ i ]] += sparse.masses[ i ];
+    }
+    return result;
+}
+
+// =================================================================================================
+//     Sparse Tree
+// =================================================================================================
+
+/**
+ * Ancestor and LCA structures of a FlatTree, precomputed once per reference tree, so that a sample
+ * can be evaluated on the subtree spanned by its occupied edges only.
+ *
+ * As the positions are in postorder, the subtree below an edge is the contiguous range
+ * `[ subtree_begin(p), p ]`. For two positions `v < u`, the LCA is the parent of the shallowest
+ * position in `[ v, u )`, which we answer in constant time with a sparse table over the depths.
+ * The sparse table needs `n log n` 32bit entries for `n` edges.
+ *
+ * In here, the root node is represented by FlatTree::npos.
+ */
+class SparseTree
+{
+public:
+
+    /**
+     * Samples that occupy at least this fraction of the edges are evaluated with the dense scan.
+     */
+    static constexpr double dense_fraction = 1.0 / 16.0;
+
+    explicit SparseTree( FlatTree const& tree )
+        : tree_( &tree )
+    {
+        auto const n = tree.size();
+        parent_.assign( n, FlatTree::npos );
+        subtree_begin_.resize( n );
+        depth_.resize( n );
+        root_distance_.resize( n );
+
+        for( size_t pos = 0; pos < n; ++pos ) {
+            if( tree.is_leaf( pos ) ) {
+                subtree_begin_[ pos ] = pos;
+                continue;
+            }
+            subtree_begin_[ pos ] = pos;
+            for( auto const child : tree.children_of( pos ) ) {
+                parent_[ child ] = pos;
+                subtree_begin_[ pos ] = std::min( subtree_begin_[ pos ], subtree_begin_[ child ] );
+            }
+        }
+
+        // top-down, parents come after their children in postorder
+        for( size_t i = n; i > 0; --i ) {
+            auto const pos = i - 1;
+            auto const par = parent_[ pos ];
+            depth_[ pos ]         = ( par == FlatTree::npos ? 1 : depth_[ par ] + 1 );
+            root_distance_[ pos ] = ( par == FlatTree::npos ? 0.0 : root_distance_[ par ] )
+                                  + tree.branch_length[ pos ];
+        }
+
+        // sparse table of the position with minimal depth in each range [ i, i + 2^level )
+        shallowest_.emplace_back( n );
+        std::iota( shallowest_[0].begin(), shallowest_[0].end(), 0 );
+        for( size_t level = 1; ( size_t( 1 ) << level ) <= n; ++level ) {
+            auto const half = size_t( 1 ) << ( level - 1 );
+            auto const& prev = shallowest_[ level - 1 ];
+            std::vector< uint32_t > curr( n - ( size_t( 1 ) << level ) + 1 );
+            for( size_t i = 0; i < curr.size(); ++i ) {
+                curr[ i ] = shallower( prev[ i ], prev[ i + half ] );
+            }
+            shallowest_.push_back( std::move( curr ));
+        }
+    }
+
+    FlatTree const& flat_tree() const
+    {
+        return *tree_;
+    }
+
+    size_t parent( size_t const pos ) const
+    {
+        return parent_[ pos ];
+    }
+
+    /**
+     * Distance from the root to the lower end of the edge at @p pos.
+     */
+    double root_distance( size_t const pos ) const
+    {
+        return pos == FlatTree::npos ? 0.0 : root_distance_[ pos ];
+    }
+
+    /**
+     * First position of the subtree below the edge at @p pos, which ends at @p pos itself.
+     */
+    size_t subtree_begin( size_t const pos ) const
+    {
+        return subtree_begin_[ pos ];
+    }
+
+    /**
+     * Whether @p anc is @p pos itself or one of its ancestors.
+     */
+    bool is_ancestor( size_t const anc, size_t const pos ) const
+    {
+        return anc == FlatTree::npos or ( subtree_begin_[ anc ] <= pos and pos <= anc );
+    }
+
+    size_t lca( size_t const a, size_t const b ) const
+    {
+        if( a == b ) {
+            return a;
+        }
+        auto const lo = std::min( a, b );
+        auto const hi = std::max( a, b );
+
+        // shallowest position in [ lo, hi ), whose parent is the lca
+        size_t level = 0;
+        while(( size_t( 2 ) << level ) <= hi - lo ) {
+            ++level;
+        }
+        auto const m = shallower(
+            shallowest_[ level ][ lo ], shallowest_[ level ][ hi - ( size_t( 1 ) << level ) ]
+        );
+        return parent_[ m ];
+    }
+
+private:
+
+    uint32_t shallower( uint32_t const a, uint32_t const b ) const
+    {
+        return depth_[ b ] < depth_[ a ] ? b : a;
+    }
+
+    FlatTree const* tree_;
+
+    std::vector< size_t > parent_;
+    std::vector< size_t > subtree_begin_;
+    std::vector< uint32_t > depth_;
+    std::vector< double > root_distance_;
+    std::vector< std::vector< uint32_t >> shallowest_;
+};
+
+// =================================================================================================
+//     Sparse BWPD
+// =================================================================================================
+
+/**
+ * BWPD over the subtree spanned by the occupied edges of a sample, see BWPD() for the parameters.
+ *
+ * Only edges whose distal side holds some, but not all of the mass can contribute, and those form
+ * the paths between the occupied edges. We build the virtual tree of the occupied edges and the
+ * LCAs of neighbouring ones, and use that all edges on the path between a virtual node and its
+ * virtual parent share the same D(i). This takes `O(k log k)` for `k` occupied edges, independent
+ * of the size of the tree. The path lengths are differences of root distances, so that the results
+ * are equal to the dense scan up to floating point rounding.
+ *
+ * If the sample occupies more than SparseTree::dense_fraction of the edges, the dense scan over
+ * the whole tree is used instead.
+ *
+ * The masses are read through a SparseView, so that they can be used in place; repeated
+ * positions are summed up.
+ */
+template< class accumulator_t, class distal_sum_t, class position_t >
+void BWPD(
+    SparseTree const& sparse_tree,
+    SparseView< position_t > const& sparse,
+    double const total,
+    accumulator_t& accumulator,
+    distal_sum_t distal_sum
+) {
+    auto const& tree = sparse_tree.flat_tree();
+    if( static_cast< double >( sparse.size ) >= SparseTree::dense_fraction * tree.size() ) {
+        BWPD( tree, to_dense( sparse, tree.size() ), total, accumulator, distal_sum );
+        return;
+    }
+    assert( std::is_sorted( sparse.positions, sparse.positions + sparse.size ));
+
+    // the virtual tree nodes: occupied positions and the lcas of neighbours, in postorder
+    std::vector< size_t > nodes( sparse.positions, sparse.positions + sparse.size );
+    for( size_t i = 1; i < sparse.size; ++i ) {
+        auto const lca = sparse_tree.lca( sparse.positions[ i - 1 ], sparse.positions[ i ] );
+        if( lca != FlatTree::npos ) {
+            nodes.push_back( lca );
+        }
+    }
+    std::sort( nodes.begin(), nodes.end() );
+    nodes.erase( std::unique( nodes.begin(), nodes.end() ), nodes.end() );
+
+    // virtual parent of each node, as index into nodes, or npos for the root.
+    // reverse postorder visits ancestors first, so a stack of the current path does the job.
+    std::vector< size_t > parents( nodes.size(), FlatTree::npos );
+    std::vector< size_t > path;
+    for( size_t i = nodes.size(); i > 0; --i ) {
+        auto const idx = i - 1;
+        while( not path.empty() and not sparse_tree.is_ancestor( nodes[ path.back() ], nodes[ idx ] )) {
+            path.pop_back();
+        }
+        if( not path.empty() ) {
+            parents[ idx ] = path.back();
+        }
+        path.push_back( idx );
+    }
+
+    // mass strictly below each node, and including the node's own edge
+    std::vector< double > distal( nodes.size(), 0.0 );
+    std::vector< double > full( nodes.size(), 0.0 );
+    size_t s = 0;
+    for( size_t i = 0; i < nodes.size(); ++i ) {
+        full[ i ] = distal[ i ];
+        while( s < sparse.size and sparse.positions[ s ] == nodes[ i ] ) {
+            full[ i ] += sparse.masses[ s ];
+            ++s;
+        }
+        if( parents[ i ] != FlatTree::npos ) {
+            distal[ parents[ i ]] += full[ i ];
+        }
+    }
+
+    for( size_t i = 0; i < nodes.size(); ++i ) {
+        auto const pos = nodes[ i ];
+
+        // masses on edges without any distal mass, unless they are adjacent to the root
+        if( equals_approx( distal[ i ] / total, 0.0 ) and sparse_tree.parent( pos ) != FlatTree::npos ) {
+            distal_sum( pos, accumulator );
+        }
+
+        // the edge of the node itself
+        if( not tree.is_leaf( pos ) ) {
+            accumulator.add( tree.branch_length[ pos ], distal[ i ] / total );
+        }
+
+        // the edges between the node and its virtual parent, which all have the same D(i)
+        auto const parent_pos = parents[ i ] == FlatTree::npos ? FlatTree::npos : nodes[ parents[ i ]];
+        auto const length = sparse_tree.root_distance( pos ) - tree.branch_length[ pos ]
+                          - sparse_tree.root_distance( parent_pos );
+        if( length > 0.0 ) {
+            accumulator.add( length, full[ i ] / total );
+        }
+    }
+}
+
+template< class accumulator_t, class distal_sum_t >
+void BWPD(
+    SparseTree const& sparse_tree,
+    SparseMasses const& sparse,
+    double const total,
+    accumulator_t& accumulator,
+    distal_sum_t distal_sum
+) {
+    BWPD( sparse_tree, sparse_view( sparse ), total, accumulator, distal_sum );
+}
+
+template< class accumulator_t, class position_t >
+void BWPD(
+    SparseTree const& sparse_tree,
+    SparseView< position_t > const& sparse,
+    double const total,
+    accumulator_t& accumulator
+) {
+    BWPD( sparse_tree, sparse, total, accumulator, NoDistalSum() );
+}
+
+template< class accumulator_t >
+void BWPD(
+    SparseTree const& sparse_tree,
+    SparseMasses const& sparse,
+    double const total,
+    accumulator_t& accumulator
+) {
+    BWPD( sparse_tree, sparse_view( sparse ), total, accumulator, NoDistalSum() );
+}
+
+#endif // include guard
@@ -0,0 +1,168 @@
+#ifndef DIVERSITY_TASK_GRAPH_H_
+#define DIVERSITY_TASK_GRAPH_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include "parallel.hpp"
+
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// =================================================================================================
+//     Task Graph
+// =================================================================================================
+
+/**
+ * Tasks with dependencies between them, run by a pool of threads.
+ *
+ * A task starts once all tasks it depends on have finished. Of the tasks that are ready, the one
+ * that became ready last runs first, so that the tasks that consume the result of a task (say, the
+ * computations on a parsed sample) run right after it, and its result can be freed soon. Tasks
+ * that are ready from the start run in the order in which they were added.
+ *
+ * As the graph keeps all threads busy on its own, parallel loops within a task run on the thread
+ * of the task only. Once a task throws, no further tasks are started, and the first exception is
+ * rethrown by run() after the running tasks have finished.
+ */
+class TaskGraph
+{
+public:
+
+    using task_function = std::function< void() >;
+
+    /**
+     * Add a task that runs after all of the @p dependencies, given as ids returned by earlier
+     * add() calls. Returns the id of the task.
+     */
+    size_t add( task_function task, std::vector< size_t > const& dependencies = {} )
+    {
+        auto const id = tasks_.size();
+        tasks_.emplace_back();
+        tasks_.back().function = std::move( task );
+        for( auto const dependency : dependencies ) {
+            assert( dependency < id );
+            tasks_[ dependency ].dependents.push_back( id );
+            ++tasks_.back().pending;
+        }
+        return id;
+    }
+
+    size_t size() const
+    {
+        return tasks_.size();
+    }
+
+    /**
+     * Run all tasks on @p workers threads, and return once they are done.
+     */
+    void run( size_t const workers )
+    {
+        for( size_t i = tasks_.size(); i > 0; --i ) {
+            if( tasks_[ i - 1 ].pending == 0 ) {
+                ready_.push_back( i - 1 );
+            }
+        }
+
+        std::vector< std::thread > threads;
+        for( size_t i = 0; i < ( workers == 0 ? 1 : workers ); ++i ) {
+            threads.emplace_back( &TaskGraph::work, this );
+        }
+        for( auto& thread : threads ) {
+            thread.join();
+        }
+
+        if( error_ ) {
+            std::rethrow_exception( error_ );
+        }
+    }
+
+private:
+
+    struct Task
+    {
+        task_function function;
+        std::vector< size_t > dependents;
+        size_t pending = 0;
+    };
+
+    void work()
+    {
+        set_num_threads( 1 );
+
+        std::unique_lock< std::mutex > lock( mutex_ );
+        while( true ) {
+            changed_.wait( lock, [&](){
+                return not ready_.empty() or error_ or finished_ == tasks_.size() or running_ == 0;
+            });
+            if( ready_.empty() or error_ ) {
+                // nothing left that could become ready, wake up the others to let them stop as well
+                changed_.notify_all();
+                return;
+            }
+            auto const id = ready_.back();
+            ready_.pop_back();
+            ++running_;
+            lock.unlock();
+
+            std::exception_ptr error;
+            try {
+                tasks_[ id ].function();
+            } catch( ... ) {
+                error = std::current_exception();
+            }
+            // free whatever the task holds on to
+            tasks_[ id ].function = nullptr;
+
+            lock.lock();
+            --running_;
+            ++finished_;
+            if( error and not error_ ) {
+                error_ = error;
+            }
+            for( auto const dependent : tasks_[ id ].dependents ) {
+                if( --tasks_[ dependent ].pending == 0 ) {
+                    ready_.push_back( dependent );
+                }
+            }
+            changed_.notify_all();
+        }
+    }
+
+    std::vector< Task > tasks_;
+
+    std::vector< size_t > ready_;
+    size_t running_  = 0;
+    size_t finished_ = 0;
+    std::exception_ptr error_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+};
+
+#endif // include guard
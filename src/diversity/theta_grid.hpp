@@ -0,0 +1,130 @@
+#ifndef DIVERSITY_THETA_GRID_H_
+#define DIVERSITY_THETA_GRID_H_
+
+/*
+    Copyright (C) 2019 Pierre Barbera
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Contact:
+    Pierre Barbera <pierre.barbera@h-its.org>
+    Exelixis Lab, Heidelberg Institute for Theoretical Studies
+    Schloss-Wolfsbrunnenweg 35, D-69118 Heidelberg, Germany
+*/
+
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// =================================================================================================
+//     Theta Grid
+// =================================================================================================
+
+/**
+ * Evenly spaced thetas `from, ..., to` with @p steps values, for evaluating BWPD as a curve.
+ * A grid with zero steps is empty.
+ */
+struct ThetaGrid
+{
+    double from  = 0.0;
+    double to    = 1.0;
+    size_t steps = 0;
+
+    double step_width() const
+    {
+        return steps < 2 ? 0.0 : ( to - from ) / static_cast< double >( steps - 1 );
+    }
+
+    double theta( size_t const i ) const
+    {
+        return i + 1 == steps and steps > 1 ? to : from + static_cast< double >( i ) * step_width();
+    }
+};
+
+/**
+ * Parse a grid given as `from:to:steps`, for example `0:1:500`.
+ */
+inline ThetaGrid parse_theta_grid( std::string const& spec )
+{
+    auto const first  = spec.find( ':' );
+    auto const second = spec.find( ':', first == std::string::npos ? first : first + 1 );
+    if( first == std::string::npos or second == std::string::npos ) {
+        throw std::runtime_error( "Invalid theta grid '" + spec + "', expecting from:to:steps" );
+    }
+
+    ThetaGrid grid;
+    char* end = nullptr;
+    grid.from  = std::strtod( spec.c_str(), &end );
+    bool valid = ( end == spec.c_str() + first );
+    grid.to    = std::strtod( spec.c_str() + first + 1, &end );
+    valid      = valid and ( end == spec.c_str() + second );
+    grid.steps = std::strtoul( spec.c_str() + second + 1, &end, 10 );
+    valid      = valid and ( *end == '\0' and grid.steps > 0 );
+
+    if( not valid or grid.from < 0.0 or grid.to > 1.0 or grid.from > grid.to ) {
+        throw std::runtime_error( "Invalid theta grid '" + spec + "', expecting from:to:steps within [0,1]" );
+    }
+    return grid;
+}
+
+// =================================================================================================
+//     Curve Kernel
+// =================================================================================================
+
+/**
+ * Evaluate `sum_j length_j * x_j^theta` for all thetas of the grid, given `log_x_j` of every
+ * spanning-tree term, and write the values to @p curve.
+ *
+ * Instead of one `pow` per term and theta, we use that along an evenly spaced grid
+ * `x^(theta + step) = x^theta * x^step`: per term, two `exp` calls set up the start value and the
+ * factor, and each theta then costs one multiply-add per term. The loop over the terms is
+ * contiguous and vectorized. As `x <= 1`, the products shrink, so that the rounding error grows
+ * at most linearly with the number of steps, which stays far below the output precision.
+ */
+inline void theta_curve(
+    std::vector< double > const& log_x,
+    std::vector< double > const& lengths,
+    ThetaGrid const& grid,
+    double* curve
+) {
+    assert( log_x.size() == lengths.size() );
+    auto const m = log_x.size();
+
+    std::vector< double > power( m );
+    std::vector< double > factor( m );
+    for( size_t j = 0; j < m; ++j ) {
+        power[ j ]  = std::exp( grid.from * log_x[ j ] );
+        factor[ j ] = std::exp( grid.step_width() * log_x[ j ] );
+    }
+
+    double* power_ptr = power.data();
+    double const* factor_ptr = factor.data();
+    double const* length_ptr = lengths.data();
+
+    for( size_t t = 0; t < grid.steps; ++t ) {
+        double sum = 0.0;
+
+        #pragma omp simd reduction( +: sum )
+        for( size_t j = 0; j < m; ++j ) {
+            sum += length_ptr[ j ] * power_ptr[ j ];
+            power_ptr[ j ] *= factor_ptr[ j ];
+        }
+        curve[ t ] = sum;
+    }
+}
+
+#endif // include guard
@@ -22,290 +22,1507 @@
 
 #include "genesis/genesis.hpp"
 
+#include "diversity/beta.hpp"
+#include "diversity/bwpd.hpp"
+#include "diversity/cache.hpp"
+#include "diversity/chunked.hpp"
+#include "diversity/clade_profile.hpp"
+#include "diversity/count_allocations.hpp"
+#include "diversity/flat_masses.hpp"
+#include "diversity/flat_tree.hpp"
+#include "diversity/functions.hpp"
+#include "diversity/gzip_input.hpp"
+#include "diversity/incremental.hpp"
+#include "diversity/metrics.hpp"
+#include "diversity/nhx_reader.hpp"
+#include "diversity/options.hpp"
+#include "diversity/output.hpp"
+#include "diversity/parallel.hpp"
+#include "diversity/placement_filter.hpp"
+#include "diversity/prefetch.hpp"
+#include "diversity/profile.hpp"
+#include "diversity/resample.hpp"
+#include "diversity/server.hpp"
+#include "diversity/shard.hpp"
+#include "diversity/sparse.hpp"
+#include "diversity/task_graph.hpp"
+
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <fstream>
 #include <functional>
 #include <iomanip>
 #include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#if defined( __unix__ ) || defined( __APPLE__ )
+#   include <glob.h>
+#endif
+
 using namespace genesis;
 using namespace genesis::placement;
 using namespace genesis::tree;
 using namespace genesis::utils;
 
-bool equals_approx( double const a, double const b, double const epsilon = 1e-10 )
+size_t num_queries( Sample const& sample )
 {
-  return std::abs( a - b ) < epsilon;
+  return total_name_count( sample );
 }
 
-double phylo_entropy_g( double const x )
+/**
+ * Number of queries per FlatTree position. By default, only the best hit (most likely placement)
+ * of each pquery counts, the same way as `pqueries_per_edge( sample, true )` does. Otherwise, the
+ * name count of each pquery is spread over its placements according to the @p filter.
+ */
+SparseMasses query_counts( Sample const& sample, FlatTree const& flat_tree, PlacementFilter const& filter )
 {
-  if( equals_approx( x, 0.0 ) ) {
-    return 0.0;
+  static thread_local WeightedCounts counts;
+  static thread_local std::vector< size_t > positions;
+  static thread_local std::vector< double > lwrs;
+
+  counts.reset( flat_tree.size() );
+  for( auto const& pquery : sample.pqueries() ) {
+    positions.clear();
+    lwrs.clear();
+    for( auto const& placement : pquery.placements() ) {
+      positions.push_back( flat_tree.position[ placement.edge().index() ] );
+      lwrs.push_back( placement.like_weight_ratio );
+    }
+    counts.add( positions.data(), lwrs.data(), positions.size(), pquery.name_size(), filter );
   }
-  return x * std::log( x );
+  return counts.result();
 }
 
-double phylo_quad_entropy_g( double const x )
+/**
+ * Name of a sample read from the given file: the file name without directory and extension,
+ * and without a `.gz` extension in front of that.
+ */
+std::string sample_name( std::string const& jplace_file )
 {
-  return x * ( 1.0 - x );
+  auto name = file_basename( jplace_file );
+  if( name.size() > 3 and name.compare( name.size() - 3, 3, ".gz" ) == 0 ) {
+    name = name.substr( 0, name.size() - 3 );
+  }
+  return file_filename( name );
 }
 
-double step_function_g( double const x, double const theta )
+/**
+ * All samples of a run are placed on the same reference tree, whose FlatTree is only built once.
+ */
+void check_reference_tree( Sample const& sample, FlatTree const& flat_tree )
 {
-  assert( theta >= 0.0 and theta <= 1.0 );
+  if( sample.tree().edge_count() != flat_tree.size() ) {
+    throw std::runtime_error( "jplace files are not placed on the same reference tree!" );
+  }
+}
 
-  // special case: only consider edges in the spanning tree of the sample
-  // (0 or 1 fraction means non-shared edge, which means the edge is not in the spanning)
-  if( equals_approx( x, 0.0 ) or equals_approx( x, 1.0 ) ) {
-    return 0.0;
+/**
+ * Read one jplace file, counting its size and the number of placements for the profile.
+ * Gzipped files are decompressed in memory first, see read_input_file().
+ */
+Sample read_jplace( std::string const& jplace_file )
+{
+  ProfileTimer const timer( "read_jplace" );
+  Sample sample;
+  if( is_gzip_file( jplace_file ) ) {
+    static thread_local std::string text;
+    {
+      ProfileTimer const timer( "inflate" );
+      read_input_file( jplace_file, text );
+    }
+    sample = JplaceReader().read( from_string( text ) );
+    trim_input_buffer( text );
+  } else {
+    sample = JplaceReader().read( from_file( jplace_file ) );
+  }
+  if( Profile::global().enabled() ) {
+    Profile::global().count( "bytes_read", input_file_size( jplace_file ) );
+    Profile::global().count( "placements", total_placement_count( sample ) );
+  }
+  return sample;
+}
+
+/**
+ * Metrics based on the query counts of the best hit per pquery.
+ */
+std::vector< double > count_row(
+  Sample const& sample,
+  SparseTree const& sparse_tree,
+  MetricSet const& metrics,
+  PlacementFilter const& filter
+) {
+  // if we only take the best hits, num_placements = num_pqueries, making the
+  // total size, including multiplicities, simply the name count:
+  double const total_queries = num_queries( sample );
+
+  SparseMasses counts;
+  {
+    ProfileTimer const timer( "query_counts" );
+    counts = query_counts( sample, sparse_tree.flat_tree(), filter );
   }
 
-  return std::pow( 2 * std::min( x, 1.0 - x ), theta );
+  // Phylogenetic Entropy, Phylogenetic Quadratic Entropy and BWPD, all in one traversal
+  ProfileTimer const timer( "bwpd_counts" );
+  MetricAccumulator accumulator( metrics );
+  BWPD( sparse_tree, counts, total_queries, accumulator );
+  Profile::global().count( "edges_visited", accumulator.terms() );
+  return accumulator.row();
 }
 
-size_t num_queries( std::vector< Pquery const* > const& pqs )
-{
-  size_t sum = 0;
-  for( auto const& pq_ptr : pqs ) {
-    sum += pq_ptr->name_size();
+/**
+ * The placement masses of a sample (like weight ratio times multiplicity) at their proximal
+ * lengths, the same as `convert_sample_to_mass_tree( sample, normalize )`, but collected into
+ * FlatMasses instead of a MassTree. The weight ratios need to be normalized already.
+ */
+void placement_masses(
+  Sample const& sample,
+  FlatTree const& flat_tree,
+  bool const normalize,
+  FlatMassBuilder& builder,
+  FlatMasses& result
+) {
+  ProfileTimer const timer( "flat_masses" );
+  builder.reset( flat_tree.size() );
+  for( auto const& pquery : sample.pqueries() ) {
+    auto const multiplicity = total_multiplicity( pquery );
+    for( auto const& placement : pquery.placements() ) {
+      builder.add(
+        flat_tree.position[ placement.edge().index() ],
+        placement.proximal_length,
+        placement.like_weight_ratio * multiplicity
+      );
+    }
   }
-  return sum;
+  builder.build( result, normalize );
 }
 
-size_t num_queries( Sample const& sample )
+/**
+ * Metrics based on the mass tree of the sample, that is, on all placements weighted by their
+ * like weight ratio. This normalizes the weight ratios of the sample.
+ * The masses are collected by a builder per thread, instead of building a MassTree per sample.
+ */
+std::vector< double > mass_row( Sample& sample, FlatTree const& flat_tree, MetricSet const& metrics )
 {
-  return total_name_count( sample );
+  {
+    ProfileTimer const timer( "normalize_weight_ratios" );
+    normalize_weight_ratios( sample );
+  }
+
+  static thread_local FlatMassBuilder builder;
+  static thread_local FlatMasses masses;
+  static thread_local std::vector< double > mass_per_edge;
+  placement_masses( sample, flat_tree, true, builder, masses );
+  masses.edge_masses( mass_per_edge );
+
+  // the masses are already normalized, so D(i) is the distal mass itself
+  ProfileTimer const timer( "bwpd_masses" );
+  MetricAccumulator accumulator( metrics );
+  BWPD( flat_tree, mass_per_edge, 1.0, accumulator );
+  Profile::global().count( "edges_visited", accumulator.terms() );
+  return accumulator.row();
 }
 
 /**
- * https://dx.doi.org/10.7717%2Fpeerj.157
- *
- * @param  sample [description]
- * @param  theta  [description]
- * @return        [description]
+ * Names of the metrics of the count based row, followed by the ones of the mass based row,
+ * prefixed by `mass_`, so that both fit into one table with a single header.
  */
-template< class g_func_t, class... Args >
-double BWPD( Sample const& sample, g_func_t g_func, Args... args )
+std::vector< std::string > count_and_mass_names( MetricSet const& metrics )
 {
-  /*  The goal is to iterate over all edges and calculate D_s(i), which is
-        the fraction of reads in sample s that are in leaves (or edges / placements
-        in our case) on the distal side of edge i. Then, the BWPD is the sum of edge
-        length l(i) multiplied by [2min(D(i),1−D(i))]^θ. For θ=0, and evaluating only
-        those edges that are in a samples spanning tree, this results in the somewhat
-        classical FaithPD, except adapted to phylogenetic placement.
-    */
+  auto result = metric_names( metrics );
+  for( auto const& name : metric_names( metrics ) ) {
+    result.push_back( "mass_" + name );
+  }
+  return result;
+}
 
-  // assert( theta >= 0.0 and theta <= 1.0 );
+std::vector< double > join_rows( std::vector< double > count_row, std::vector< double > const& mass_row )
+{
+  count_row.insert( count_row.end(), mass_row.begin(), mass_row.end() );
+  return count_row;
+}
 
-  // we start by first calculating D(i) for every edge in the tree
-  // which we do bottom-up, post-order, dragging with us previous distal-side
-  // counts, dividing them by the total count
+void write_header( MetricSet const& metrics, std::ostream& out )
+{
+  out << "sample";
+  for( auto const& name : metric_names( metrics ) ) {
+    out << "," << name;
+  }
+  out << "\n";
+}
 
-  auto const& place_tree = sample.tree();
-  auto pqrs_per_edge     = pqueries_per_edge( sample, true );
+void write_row( std::string const& name, std::vector< double > const& row, std::ostream& out )
+{
+  std::string line = name;
+  for( auto const value : row ) {
+    line += ',';
+    append_double( line, value );
+  }
+  out << line << "\n";
+}
 
-  // if we only take the best hits, num_placements = num_pqueries, making the
-  // total size, including multiplicities, simply the name count:
-  double const total_queries = num_queries( sample );
+/**
+ * Read all samples at once, then evaluate them in parallel.
+ */
+void run_sample_set(
+  std::vector< std::string > const& jplace_files,
+  MetricSet const& metrics,
+  PlacementFilter const& filter,
+  TableFormat const& format
+) {
+  SampleSet samples;
+  {
+    std::vector< Sample > read_samples( jplace_files.size() );
+    parallel_for( jplace_files.size(), [&]( size_t const i ) {
+      ProfileSample const profile_sample( sample_name( jplace_files[ i ] ) );
+      read_samples[ i ] = read_jplace( jplace_files[ i ] );
+    });
+    for( size_t i = 0; i < jplace_files.size(); ++i ) {
+      samples.add( std::move( read_samples[ i ] ), sample_name( jplace_files[ i ] ));
+    }
+  }
+  if( samples.size() == 0 ) {
+    // still write the header, so that an empty shard can be merged
+    TableWriter table( { "sample" }, count_and_mass_names( metrics ), format );
+    table.finish();
+    return;
+  }
 
-  // vector to track the number of queries on the distal side of the edge
-  std::vector< size_t > per_edge_distal_count( place_tree.edge_count() );
-  // same idea, but for D(i)
-  std::vector< double > per_edge_D( place_tree.edge_count() );
+  // postorder topology of the reference tree, shared by all samples
+  auto const flat_tree = make_flat_tree< PlacementEdgeData >( samples[ 0 ].tree() );
+  for( size_t i = 0; i < samples.size(); ++i ) {
+    check_reference_tree( samples[ i ], flat_tree );
+  }
+  SparseTree const sparse_tree( flat_tree );
+
+  // the samples are evaluated in parallel, each into its own row, which are then written in order.
+  // the count based metrics come first, as mass_row() normalizes the weight ratios of the sample.
+  std::vector< std::string > names( samples.size() );
+  std::vector< std::vector< double > > rows( samples.size() );
+  parallel_for( samples.size(), [&]( size_t const i ) {
+    ProfileSample const profile_sample( samples.name_at( i ) );
+    names[ i ] = samples.name_at( i );
+    auto const counts = count_row( samples[ i ], sparse_tree, metrics, filter );
+    rows[ i ]  = join_rows( counts, mass_row( samples[ i ], flat_tree, metrics ));
+  });
+
+  ProfileTimer const timer( "write_results" );
+  TableWriter table( { "sample" }, count_and_mass_names( metrics ), format );
+  table.add_rows( names, rows );
+  table.finish();
+}
 
-  double result = 0.0;
+/**
+ * Read, evaluate, emit and free one sample at a time, so that peak memory depends on the largest
+ * sample instead of the whole data set. Up to @p prefetch samples are parsed ahead by @p threads
+ * background readers, so that parsing overlaps the computation.
+ */
+void run_stream(
+  std::vector< std::string > const& jplace_files,
+  MetricSet const& metrics,
+  PlacementFilter const& filter,
+  TableFormat const& format,
+  size_t const prefetch,
+  size_t const threads
+) {
+  OrderedPrefetcher< Sample > samples( jplace_files.size(), prefetch, threads, [&]( size_t const i ) {
+    ProfileSample const profile_sample( sample_name( jplace_files[ i ] ) );
+    return read_jplace( jplace_files[ i ] );
+  });
+
+  std::unique_ptr< FlatTree > flat_tree;
+  std::unique_ptr< SparseTree > sparse_tree;
+  TableWriter table( { "sample" }, count_and_mass_names( metrics ), format );
+
+  for( size_t i = 0; i < jplace_files.size(); ++i ) {
+    auto sample = samples.next();
+    ProfileSample const profile_sample( sample_name( jplace_files[ i ] ) );
+
+    // postorder topology of the reference tree, built from the first sample
+    if( not flat_tree ) {
+      flat_tree = std::unique_ptr< FlatTree >(
+        new FlatTree( make_flat_tree< PlacementEdgeData >( sample.tree() ))
+      );
+      sparse_tree = std::unique_ptr< SparseTree >( new SparseTree( *flat_tree ));
+    }
+    check_reference_tree( sample, *flat_tree );
 
-  // traverse the tree
-  for( auto const& it : postorder( place_tree ) ) {
-    // ensure last edge isn't visited twice
-    if( it.is_last_iteration() ) {
-      continue;
+    auto const counts = count_row( sample, *sparse_tree, metrics, filter );
+    table.add_row( sample_name( jplace_files[ i ] ), join_rows( counts, mass_row( sample, *flat_tree, metrics )));
+  }
+  table.finish();
+}
+
+/**
+ * Add the rows of the count and mass based profiles of one sample to the @p table, for all clades
+ * that hold any placement mass. Clades without any query count get zeros for the count metrics.
+ */
+void add_clade_rows(
+  std::string const& name,
+  CladeProfile const& count_profile,
+  CladeProfile const& mass_profile,
+  std::vector< int > const& edge_nums,
+  MetricSet const& metrics,
+  TableWriter& table
+) {
+  std::vector< std::string > keys = { name, "" };
+  std::vector< double > row( 2 + 2 * metrics.row_size() );
+  size_t c = 0;
+  for( size_t i = 0; i < mass_profile.size(); ++i ) {
+    auto const pos = mass_profile.positions[ i ];
+    while( c < count_profile.size() and count_profile.positions[ c ] < pos ) {
+      ++c;
+    }
+    bool const counted = c < count_profile.size() and count_profile.positions[ c ] == pos;
+
+    keys[1] = std::to_string( edge_nums[ pos ] );
+    row[0]  = counted ? count_profile.clade_mass[ c ] : 0.0;
+    row[1]  = mass_profile.clade_mass[ i ];
+    for( size_t k = 0; k < metrics.row_size(); ++k ) {
+      row[ 2 + k ] = counted ? count_profile.row( c, metrics )[ k ] : 0.0;
+      row[ 2 + metrics.row_size() + k ] = mass_profile.row( i, metrics )[ k ];
     }
+    table.add_row( keys.data(), row.data() );
+  }
+}
 
-    auto const& edge       = it.edge();
-    auto const& edge_index = edge.index();
+/**
+ * Metrics of every clade of the reference tree, one row per sample and inner edge (named by its
+ * jplace edge_num) whose clade holds any mass, renormalized to the mass of that clade.
+ * As in run_stream(), the samples are read one at a time.
+ */
+void run_clades(
+  std::vector< std::string > const& jplace_files,
+  MetricSet const& metrics,
+  PlacementFilter const& filter,
+  TableFormat const& format,
+  size_t const prefetch,
+  size_t const threads
+) {
+  OrderedPrefetcher< Sample > samples( jplace_files.size(), prefetch, threads, [&]( size_t const i ) {
+    ProfileSample const profile_sample( sample_name( jplace_files[ i ] ) );
+    return read_jplace( jplace_files[ i ] );
+  });
+
+  std::unique_ptr< FlatTree > flat_tree;
+  std::vector< int > edge_nums;
+  CladeProfile count_profile;
+  CladeProfile mass_profile;
+  FlatMassBuilder builder;
+  FlatMasses masses;
+  std::vector< double > mass_per_edge;
+
+  auto columns = count_and_mass_names( metrics );
+  columns.insert( columns.begin(), { "clade_count", "clade_mass" });
+  TableWriter table( { "sample", "edge_num" }, columns, format );
+
+  for( size_t i = 0; i < jplace_files.size(); ++i ) {
+    auto sample = samples.next();
+    ProfileSample const profile_sample( sample_name( jplace_files[ i ] ) );
+
+    if( not flat_tree ) {
+      flat_tree = std::unique_ptr< FlatTree >(
+        new FlatTree( make_flat_tree< PlacementEdgeData >( sample.tree() ))
+      );
+      for( auto const index : flat_tree->edge_index ) {
+        edge_nums.push_back( sample.tree().edge_at( index ).data< PlacementEdgeData >().edge_num() );
+      }
+    }
+    check_reference_tree( sample, *flat_tree );
 
-    // if this is a leaf, there cannot be any mass on the distal side, so we skip
-    if( is_leaf( edge ) ) {
-      per_edge_distal_count[ edge_index ] = 0;
-      per_edge_D[ edge_index ]            = 0.0;
-      // per_edge_distal_count[ edge_index ]   = num_queries( pqrs_per_edge[ edge_index ] );
-      // per_edge_D[ edge_index ]              = per_edge_distal_count[ edge_index ] / total_queries;
-      continue;
+    {
+      ProfileTimer const timer( "clade_counts" );
+      auto const counts = to_dense( query_counts( sample, *flat_tree, filter ), flat_tree->size() );
+      clade_profile( *flat_tree, counts, metrics, count_profile );
+    }
+    {
+      normalize_weight_ratios( sample );
+      placement_masses( sample, *flat_tree, true, builder, masses );
+      masses.edge_masses( mass_per_edge );
+      ProfileTimer const timer( "clade_masses" );
+      clade_profile( *flat_tree, mass_per_edge, metrics, mass_profile );
     }
+    ProfileTimer const timer( "write_results" );
+    add_clade_rows( sample_name( jplace_files[ i ] ), count_profile, mass_profile, edge_nums, metrics, table );
+  }
+  table.finish();
+}
 
-    // interior edges:
-    // calculate the new distal count as the sum of distal counts and query counts
-    // of the child edges
-    auto const& node          = it.node();
-    auto const& lhs_edge      = node.link().next().edge();
-    auto const& rhs_edge      = node.link().next().next().edge();
-    auto const lhs_edge_index = lhs_edge.index();
-    auto const rhs_edge_index = rhs_edge.index();
+/**
+ * Treat the jplace files as successive batches of placements of one sample, for example of reads
+ * that are placed while sequencing is still running, and write the count based metrics of the
+ * sample after each batch. A file given as `remove:<file>` takes a batch out again, for example
+ * to slide a window over the batches.
+ *
+ * Each placement of a batch updates the distal counts along its path to the root, and with them the
+ * running sums of IncrementalSample, from which the entropies, Faith's PD and the Hill numbers of
+ * order 0, 1 and 2 follow directly. Other metrics are evaluated on the occupied edges per batch.
+ */
+void run_incremental(
+  std::vector< std::string > const& batch_files,
+  MetricSet const& metrics,
+  PlacementFilter const& filter,
+  TableFormat const& format,
+  size_t const prefetch,
+  size_t const threads
+) {
+  std::string const remove_prefix = "remove:";
+  auto const batch_file = [&]( std::string const& arg ) {
+    return arg.compare( 0, remove_prefix.size(), remove_prefix ) == 0 ? arg.substr( remove_prefix.size() ) : arg;
+  };
+
+  OrderedPrefetcher< Sample > batches( batch_files.size(), prefetch, threads, [&]( size_t const i ) {
+    return read_jplace( batch_file( batch_files[ i ] ));
+  });
+
+  std::unique_ptr< FlatTree > flat_tree;
+  std::unique_ptr< SparseTree > sparse_tree;
+  std::unique_ptr< IncrementalSample > incremental;
+  TableWriter table( { "sample" }, metric_names( metrics ), format );
+
+  for( size_t i = 0; i < batch_files.size(); ++i ) {
+    auto const batch = batches.next();
+    ProfileSample const profile_sample( batch_files[ i ] );
+
+    if( not flat_tree ) {
+      flat_tree = std::unique_ptr< FlatTree >(
+        new FlatTree( make_flat_tree< PlacementEdgeData >( batch.tree() ))
+      );
+      sparse_tree = std::unique_ptr< SparseTree >( new SparseTree( *flat_tree ));
+      incremental = std::unique_ptr< IncrementalSample >( new IncrementalSample( *sparse_tree ));
+    }
+    check_reference_tree( batch, *flat_tree );
+
+    {
+      ProfileTimer const timer( "incremental_update" );
+      auto const counts = query_counts( batch, *flat_tree, filter );
+      if( batch_file( batch_files[ i ] ) != batch_files[ i ] ) {
+        incremental->remove( counts, num_queries( batch ));
+      } else {
+        incremental->add( counts, num_queries( batch ));
+      }
+    }
 
-    per_edge_distal_count[ edge_index ] = per_edge_distal_count[ lhs_edge_index ] + num_queries( pqrs_per_edge[ lhs_edge_index ] ) + per_edge_distal_count[ rhs_edge_index ] + num_queries( pqrs_per_edge[ rhs_edge_index ] );
+    ProfileTimer const timer( "bwpd_counts" );
+    table.add_row( batch_files[ i ], incremental->metrics( metrics ));
 
-    // per_edge_distal_count[ edge_index ] =
-    //     per_edge_distal_count[ lhs_edge_index ] +
-    //     per_edge_distal_count[ rhs_edge_index ] + num_queries( pqrs_per_edge[ edge_index ] );
+    // the next batch may take a while to arrive, so show the row right away
+    table.flush();
+  }
+  table.finish();
+}
 
-    // calculate D(i) for this edge
-    per_edge_D[ edge_index ] = per_edge_distal_count[ edge_index ] / total_queries;
+/**
+ * Count and mass based metrics of the sample given by the abundance map @p map_file, taken from
+ * the chunked placement result.
+ */
+std::vector< double > chunked_row(
+  ChunkedPlacements const& chunked,
+  SparseTree const& sparse_tree,
+  std::string const& map_file,
+  MetricSet const& metrics,
+  PlacementFilter const& filter
+) {
+  ProfileSample const profile_sample( abundance_map_sample_name( map_file ) );
+  std::vector< AbundanceEntry > abundances;
+  {
+    ProfileTimer const timer( "read_abundance_map" );
+    abundances = read_abundance_map( map_file );
+    Profile::global().count( "bytes_read", input_file_size( map_file ) );
+  }
+  ChunkedSampleMasses masses;
+  {
+    ProfileTimer const timer( "chunked_sample_masses" );
+    masses = chunked_sample_masses( chunked, abundances, filter );
+  }
 
-    auto const branch_length = edge.data< PlacementEdgeData >().branch_length;
+  std::vector< double > row;
+  {
+    ProfileTimer const timer( "bwpd_counts" );
+    MetricAccumulator count_accumulator( metrics );
+    BWPD( sparse_tree, masses.counts, masses.total_count, count_accumulator );
+    row = count_accumulator.row();
+    Profile::global().count( "edges_visited", count_accumulator.terms() );
+  }
+  {
+    ProfileTimer const timer( "bwpd_masses" );
+    MetricAccumulator mass_accumulator( metrics );
+    BWPD( sparse_tree, masses.masses, masses.total_mass, mass_accumulator );
+    row = join_rows( std::move( row ), mass_accumulator.row() );
+    Profile::global().count( "edges_visited", mass_accumulator.terms() );
+  }
+  return row;
+}
 
-    // update the BWPD sum with the result of this edge
-    result += branch_length * g_func( per_edge_D[ edge_index ], args... );
+/**
+ * Evaluate all samples directly from the chunked placement result and the abundance maps of the
+ * samples, instead of unchunkifying every sample to its own jplace file first.
+ */
+void run_chunked(
+  std::string const& chunked_file,
+  std::vector< std::string > const& map_files,
+  MetricSet const& metrics,
+  PlacementFilter const& filter,
+  TableFormat const& format
+) {
+  ChunkedPlacements chunked;
+  {
+    // the chunked sample itself is only needed until its placements are flattened
+    auto chunk = read_jplace( chunked_file );
+    ProfileTimer const timer( "make_chunked_placements" );
+    chunked    = make_chunked_placements( chunk );
   }
+  SparseTree const sparse_tree( chunked.flat_tree );
 
-  return result;
+  std::vector< std::string > names( map_files.size() );
+  std::vector< std::vector< double > > rows( map_files.size() );
+
+  parallel_for( map_files.size(), [&]( size_t const i ) {
+    names[ i ] = abundance_map_sample_name( map_files[ i ] );
+    rows[ i ]  = chunked_row( chunked, sparse_tree, map_files[ i ], metrics, filter );
+  });
+
+  ProfileTimer const timer( "write_results" );
+  TableWriter table( { "sample" }, count_and_mass_names( metrics ), format );
+  table.add_rows( names, rows );
+  table.finish();
 }
 
-template< class g_func_t, class... Args >
-double MassTreeBWPD( MassTree const& mass_tree, g_func_t g_func, Args... args )
-{
-  /*  The goal is to iterate over all edges and calculate D_s(i), which is
-        the fraction of reads in sample s that are in leaves (or edges / placements
-        in our case) on the distal side of edge i. Then, the BWPD is the sum of edge
-        length l(i) multiplied by [2min(D(i),1−D(i))]^θ. For θ=0, and evaluating only
-        those edges that are in a samples spanning tree, this results in the somewhat
-        classical FaithPD, except adapted to phylogenetic placement.
-    */
+/**
+ * The sparse query counts of all samples, which is all that the beta diversity and the
+ * resampling need. The jplace files are streamed, as only the counts of each sample are kept.
+ * With a @p chunked_file, the samples are given by the abundance maps in @p files instead.
+ *
+ * Returns the FlatTree of the reference tree, which the count positions refer to.
+ */
+FlatTree read_query_counts(
+  std::vector< std::string > const& files,
+  std::string const& chunked_file,
+  PlacementFilter const& filter,
+  size_t const prefetch,
+  size_t const threads,
+  std::vector< std::string >& names,
+  std::vector< SparseMasses >& counts,
+  std::vector< double >& totals
+) {
+  names.assign( files.size(), "" );
+  counts.assign( files.size(), SparseMasses() );
+  totals.assign( files.size(), 0.0 );
+
+  if( not chunked_file.empty() ) {
+    ChunkedPlacements chunked;
+    {
+      auto chunk = read_jplace( chunked_file );
+      ProfileTimer const timer( "make_chunked_placements" );
+      chunked    = make_chunked_placements( chunk );
+    }
+    parallel_for( files.size(), [&]( size_t const i ) {
+      ProfileSample const profile_sample( abundance_map_sample_name( files[ i ] ) );
+      ProfileTimer const timer( "chunked_sample_masses" );
+      Profile::global().count( "bytes_read", input_file_size( files[ i ] ) );
+      auto masses  = chunked_sample_masses( chunked, read_abundance_map( files[ i ] ), filter );
+      names[ i ]   = abundance_map_sample_name( files[ i ] );
+      counts[ i ]  = std::move( masses.counts );
+      totals[ i ]  = masses.total_count;
+    });
+    return std::move( chunked.flat_tree );
+  }
 
-  // assert( theta >= 0.0 and theta <= 1.0 );
+  std::unique_ptr< FlatTree > flat_tree;
+  OrderedPrefetcher< Sample > samples( files.size(), prefetch, threads, [&]( size_t const i ) {
+    ProfileSample const profile_sample( sample_name( files[ i ] ) );
+    return read_jplace( files[ i ] );
+  });
+  for( size_t i = 0; i < files.size(); ++i ) {
+    auto const sample = samples.next();
+    ProfileSample const profile_sample( sample_name( files[ i ] ) );
+    ProfileTimer const timer( "query_counts" );
+    if( not flat_tree ) {
+      flat_tree = std::unique_ptr< FlatTree >(
+        new FlatTree( make_flat_tree< PlacementEdgeData >( sample.tree() ))
+      );
+    }
+    check_reference_tree( sample, *flat_tree );
 
-  // we start by first calculating D(i) for every edge in the tree
-  // which we do bottom-up, post-order, dragging with us previous distal-side
-  // counts, dividing them by the total count
+    names[ i ]  = sample_name( files[ i ] );
+    counts[ i ] = query_counts( sample, *flat_tree, filter );
+    totals[ i ] = num_queries( sample );
+  }
+  return flat_tree ? std::move( *flat_tree ) : FlatTree();
+}
 
-  auto mass_per_edge = mass_tree_mass_per_edge( mass_tree );
+/**
+ * Pairwise distances between all samples instead of per-sample metrics, see pairwise_distances().
+ */
+void run_beta(
+  std::vector< std::string > const& files,
+  std::string const& chunked_file,
+  PlacementFilter const& filter,
+  TableFormat const& format,
+  size_t const prefetch,
+  size_t const threads
+) {
+  std::vector< std::string > names;
+  std::vector< SparseMasses > counts;
+  std::vector< double > totals;
+  auto const flat_tree = read_query_counts( files, chunked_file, filter, prefetch, threads, names, counts, totals );
+  check_beta_totals( names, totals );
+
+  std::vector< double > distances;
+  {
+    ProfileTimer const timer( "pairwise_distances" );
+    distances = pairwise_distances( flat_tree, counts, totals );
+  }
 
-  std::vector< double > per_edge_D( mass_tree.edge_count(), -1.0 );
+  std::vector< std::vector< double > > rows( names.size() );
+  for( size_t i = 0; i < names.size(); ++i ) {
+    rows[ i ].assign( distances.begin() + i * names.size(), distances.begin() + ( i + 1 ) * names.size() );
+  }
+  TableWriter table( { "sample" }, names, format );
+  table.add_rows( names, rows );
+  table.finish();
+}
 
-  double result = 0.0;
+/**
+ * Confidence intervals of the count based metrics: per sample and depth, @p replicates resampled
+ * count sets are evaluated, and each metric is reported by its mean and 95% percentile interval.
+ *
+ * Without @p depths, the replicates are bootstrapped at the depth of each sample. Otherwise, the
+ * samples are rarefied to each of the given depths, skipping samples with fewer queries.
+ * Each sample and depth draws from its own random stream, seeded from @p seed and its indices,
+ * so that the results do not depend on the number of threads.
+ */
+void run_resample(
+  std::vector< std::string > const& files,
+  std::string const& chunked_file,
+  MetricSet const& metrics,
+  TableFormat const& format,
+  size_t const replicates,
+  std::vector< size_t > const& depths,
+  size_t const seed,
+  size_t const prefetch,
+  size_t const threads
+) {
+  if( replicates == 0 ) {
+    throw std::runtime_error( "Need at least one replicate." );
+  }
 
-  size_t count = 0;
+  std::vector< std::string > names;
+  std::vector< SparseMasses > counts;
+  std::vector< double > totals;
+  // resampling draws whole queries, so it always uses the best hit counts
+  auto const flat_tree = read_query_counts(
+    files, chunked_file, PlacementFilter(), prefetch, threads, names, counts, totals
+  );
+  SparseTree const sparse_tree( flat_tree );
+
+  bool const rarefy = not depths.empty();
+  auto const depth_count = rarefy ? depths.size() : 1;
+  std::vector< size_t > row_depths( files.size() * depth_count, 0 );
+  std::vector< std::vector< double > > rows( files.size() * depth_count );
+
+  parallel_for( rows.size(), [&]( size_t const t ) {
+    auto const i = t / depth_count;
+    auto const d = t % depth_count;
+    CountResampler const resampler( counts[ i ], totals[ i ] );
+    auto const depth = rarefy ? depths[ d ] : resampler.total();
+    if( depth == 0 or depth > resampler.total() ) {
+      return;
+    }
 
-  // traverse the tree
-  for( auto const& it : postorder( mass_tree ) ) {
-    // ensure last edge isn't visited twice
-    if( it.is_last_iteration() ) {
+    ProfileSample const profile_sample( names[ i ] );
+    ProfileTimer const timer( "resampling" );
+    std::seed_seq seeds{ seed, i, d };
+    std::mt19937_64 rng( seeds );
+    row_depths[ t ] = depth;
+    rows[ t ] = resampled_row( sparse_tree, resampler, metrics, depth, rarefy, replicates, 0.95, rng );
+  });
+
+  std::vector< std::string > columns;
+  for( auto const& name : metric_names( metrics ) ) {
+    columns.push_back( name + "_mean" );
+    columns.push_back( name + "_lo" );
+    columns.push_back( name + "_hi" );
+  }
+  std::vector< std::string > keys;
+  std::vector< std::vector< double > > kept_rows;
+  for( size_t t = 0; t < rows.size(); ++t ) {
+    if( rows[ t ].empty() ) {
+      if( rarefy ) {
+        std::cerr << "Skipping sample " << names[ t / depth_count ] << " at depth "
+                  << depths[ t % depth_count ] << ", as it has fewer queries.\n";
+      } else {
+        std::cerr << "Skipping sample " << names[ t / depth_count ] << ", as it has no queries.\n";
+      }
       continue;
     }
-    ++count;
+    keys.push_back( names[ t / depth_count ] );
+    keys.push_back( std::to_string( row_depths[ t ] ));
+    kept_rows.push_back( std::move( rows[ t ] ));
+  }
+  TableWriter table( { "sample", "depth" }, columns, format );
+  table.add_rows( keys, kept_rows );
+  table.finish();
+}
 
-    auto const& edge       = it.edge();
-    auto const& edge_index = edge.index();
+/**
+ * Best hit counts and placement masses of all samples, for the cache. As with
+ * read_query_counts(), the jplace files are streamed, or, with a @p chunked_file, the samples
+ * are given by the abundance maps in @p files.
+ */
+void build_cache(
+  std::vector< std::string > const& files,
+  std::string const& chunked_file,
+  std::string const& cache_file,
+  size_t const prefetch,
+  size_t const threads
+) {
+  std::vector< CacheSample > samples( files.size() );
+
+  if( not chunked_file.empty() ) {
+    ChunkedPlacements chunked;
+    {
+      auto chunk = read_jplace( chunked_file );
+      ProfileTimer const timer( "make_chunked_placements" );
+      chunked    = make_chunked_placements( chunk );
+    }
+    parallel_for( files.size(), [&]( size_t const i ) {
+      ProfileSample const profile_sample( abundance_map_sample_name( files[ i ] ) );
+      ProfileTimer const timer( "chunked_sample_masses" );
+      Profile::global().count( "bytes_read", input_file_size( files[ i ] ) );
+
+      auto const abundances = read_abundance_map( files[ i ] );
+      auto masses = chunked_sample_masses( chunked, abundances );
+      samples[ i ].name        = abundance_map_sample_name( files[ i ] );
+      samples[ i ].input       = file_stamp( files[ i ] );
+      samples[ i ].counts      = std::move( masses.counts );
+      samples[ i ].total_count = masses.total_count;
+      samples[ i ].total_mass  = masses.total_mass;
+
+      static thread_local FlatMassBuilder builder;
+      chunked_sample_point_masses( chunked, abundances, builder, samples[ i ].masses );
+    });
+    ProfileTimer const timer( "write_cache" );
+    write_cache( cache_file, chunked.flat_tree, samples, file_stamp( chunked_file ));
+    return;
+  }
 
-    // if this is a leaf, there cannot be any mass on the distal side, so we skip
-    if( is_leaf( edge ) ) {
-      per_edge_D[ edge_index ] = 0.0;
-      continue;
+  std::unique_ptr< FlatTree > flat_tree;
+  OrderedPrefetcher< Sample > jplace_samples( files.size(), prefetch, threads, [&]( size_t const i ) {
+    ProfileSample const profile_sample( sample_name( files[ i ] ) );
+    return read_jplace( files[ i ] );
+  });
+  FlatMassBuilder builder;
+  for( size_t i = 0; i < files.size(); ++i ) {
+    auto sample = jplace_samples.next();
+    ProfileSample const profile_sample( sample_name( files[ i ] ) );
+    if( not flat_tree ) {
+      flat_tree = std::unique_ptr< FlatTree >(
+        new FlatTree( make_flat_tree< PlacementEdgeData >( sample.tree() ))
+      );
     }
+    check_reference_tree( sample, *flat_tree );
+
+    auto& entry       = samples[ i ];
+    entry.name        = sample_name( files[ i ] );
+    entry.input       = file_stamp( files[ i ] );
+    entry.counts      = query_counts( sample, *flat_tree, PlacementFilter() );
+    entry.total_count = num_queries( sample );
+
+    normalize_weight_ratios( sample );
+    placement_masses( sample, *flat_tree, false, builder, entry.masses );
+    entry.total_mass = 0.0;
+    for( auto const mass : entry.masses.masses ) {
+      entry.total_mass += mass;
+    }
+  }
+  ProfileTimer const timer( "write_cache" );
+  write_cache( cache_file, flat_tree ? *flat_tree : FlatTree(), samples );
+}
+
+/**
+ * Evaluate all samples from the binary cache file, which is built from the input files first, if
+ * it does not exist yet. Afterwards, the input files are only used to check that the cache
+ * belongs to them, so that adding metrics or thetas does not need to parse the samples again.
+ * If any of them changed since (by size or modification time), the cache is rebuilt.
+ */
+void run_cached(
+  std::vector< std::string > const& files,
+  std::string const& chunked_file,
+  std::string const& cache_file,
+  MetricSet const& metrics,
+  TableFormat const& format,
+  size_t const prefetch,
+  size_t const threads
+) {
+  bool stale = false;
+  if( file_exists( cache_file ) and not files.empty() ) {
+    DiversityCache const cache( cache_file );
+    bool matches = ( cache.sample_count() == files.size() );
+    for( size_t i = 0; matches and i < files.size(); ++i ) {
+      auto const name = chunked_file.empty() ? sample_name( files[ i ] ) : abundance_map_sample_name( files[ i ] );
+      matches = ( cache.sample_name( i ) == name );
+    }
+    if( not matches ) {
+      throw std::runtime_error(
+        "Cache file " + cache_file + " was built from different input files. Delete it to rebuild."
+      );
+    }
+    for( size_t i = 0; not stale and i < files.size(); ++i ) {
+      stale = ( cache.sample_input( i ) != file_stamp( files[ i ] ));
+    }
+    if( not chunked_file.empty() ) {
+      stale = stale or ( cache.chunked_input() != file_stamp( chunked_file ));
+    }
+    if( stale ) {
+      std::cerr << "The input files of cache file " << cache_file << " changed, rebuilding it.\n";
+    }
+  }
+  if( stale or not file_exists( cache_file ) ) {
+    if( files.empty() ) {
+      throw std::runtime_error( "Cache file " + cache_file + " does not exist, and no input files given." );
+    }
+    build_cache( files, chunked_file, cache_file, prefetch, threads );
+  }
 
-    // interior edges:
-    // calculate the new distal count as the sum of distal counts and query counts
-    // of the child edges
-    auto const& node          = it.node();
-    auto const& lhs_edge      = node.link().next().edge();
-    auto const& rhs_edge      = node.link().next().next().edge();
-    auto const lhs_edge_index = lhs_edge.index();
-    auto const rhs_edge_index = rhs_edge.index();
+  DiversityCache const cache( cache_file );
 
-    per_edge_D[ edge_index ] = per_edge_D[ lhs_edge_index ] + mass_per_edge[ lhs_edge_index ] + per_edge_D[ rhs_edge_index ] + mass_per_edge[ rhs_edge_index ];
+  auto const flat_tree = cache.flat_tree();
+  SparseTree const sparse_tree( flat_tree );
 
-    auto const branch_length = edge.data< MassTreeEdgeData >().branch_length;
+  std::vector< std::string > names( cache.sample_count() );
+  std::vector< std::vector< double > > rows( cache.sample_count() );
+  parallel_for( cache.sample_count(), [&]( size_t const i ) {
+    ProfileSample const profile_sample( cache.sample_name( i ) );
+    auto const sample = cache.sample( i );
+    names[ i ] = cache.sample_name( i );
 
-    // update the BWPD sum with the result of this edge
-    result += branch_length * g_func( per_edge_D[ edge_index ], args... );
+    {
+      ProfileTimer const timer( "bwpd_counts" );
+      MetricAccumulator accumulator( metrics );
+      BWPD( sparse_tree, cached_counts( sample ), sample.total_count, accumulator );
+      rows[ i ] = accumulator.row();
+      Profile::global().count( "edges_visited", accumulator.terms() );
+    }
+    {
+      ProfileTimer const timer( "bwpd_masses" );
+      MetricAccumulator accumulator( metrics );
+      BWPD( sparse_tree, cached_edge_masses( sample ), sample.total_mass, accumulator );
+      rows[ i ] = join_rows( std::move( rows[ i ] ), accumulator.row() );
+      Profile::global().count( "edges_visited", accumulator.terms() );
+    }
+  });
+
+  ProfileTimer const timer( "write_results" );
+  TableWriter table( { "sample" }, count_and_mass_names( metrics ), format );
+  table.add_rows( names, rows );
+  table.finish();
+}
+
+/**
+ * One job of a batch manifest: a metric family, the output file, and its input files.
+ */
+struct ManifestJob
+{
+  std::string family;
+  std::string output;
+  std::vector< std::string > inputs;
+};
+
+/**
+ * Expand an input pattern of a manifest to the matching files in sorted order, as the shell
+ * does for `*`, `?` and `[...]`. Patterns without any match yield no files, while plain file
+ * names are kept as they are, so that missing files are reported when they are read.
+ */
+std::vector< std::string > expand_input_pattern( std::string const& pattern )
+{
+  if( pattern.find_first_of( "*?[" ) == std::string::npos ) {
+    return { pattern };
   }
+#if defined( __unix__ ) || defined( __APPLE__ )
+  std::vector< std::string > result;
+  glob_t matches;
+  if( glob( pattern.c_str(), 0, nullptr, &matches ) == 0 ) {
+    for( size_t i = 0; i < matches.gl_pathc; ++i ) {
+      result.push_back( matches.gl_pathv[ i ] );
+    }
+  }
+  globfree( &matches );
+  return result;
+#else
+  throw std::runtime_error( "Input patterns such as " + pattern + " are not supported on this system." );
+#endif
+}
 
-  if( count != mass_tree.edge_count() ) {
-    throw std::runtime_error( "count != mass_tree.edge_count()" );
+/**
+ * Read a batch manifest. Each line is a job `<family> <output> <inputs...>`, where the inputs
+ * can be file name patterns, see expand_input_pattern(). The families are
+ *
+ *     bwpd      jplace files, one row of count and mass based metrics per file, as by default
+ *     beta      jplace files, their pairwise distance matrix, as with --beta
+ *     chunked   a chunked jplace file and abundance maps, one row per map, as with --chunked
+ *     scrapp    scrapp trees (summary.newick), one row per tree, as by scrapp-diversity
+ *
+ * Empty lines and lines starting with `#` are skipped.
+ */
+std::vector< ManifestJob > read_manifest( std::string const& manifest_file )
+{
+  std::ifstream in( manifest_file );
+  if( not in ) {
+    throw std::runtime_error( "Cannot read manifest " + manifest_file );
   }
 
+  std::vector< ManifestJob > result;
+  std::string line;
+  size_t line_number = 0;
+  while( std::getline( in, line )) {
+    ++line_number;
+    std::istringstream fields( line );
+    ManifestJob job;
+    if( not ( fields >> job.family ) or job.family[0] == '#' ) {
+      continue;
+    }
+    std::string pattern;
+    fields >> job.output;
+    while( fields >> pattern ) {
+      for( auto& file : expand_input_pattern( pattern )) {
+        job.inputs.push_back( std::move( file ));
+      }
+    }
+
+    auto const error = [&]( std::string const& message ) {
+      return std::runtime_error( manifest_file + ":" + std::to_string( line_number ) + ": " + message );
+    };
+    if( job.family != "bwpd" and job.family != "beta" and job.family != "chunked" and job.family != "scrapp" ) {
+      throw error( "unknown family '" + job.family + "', expecting bwpd, beta, chunked or scrapp" );
+    }
+    if( job.output.empty() or job.inputs.empty() ) {
+      throw error( "expecting <family> <output> <inputs...>, with at least one input file" );
+    }
+    if( job.family == "chunked" and job.inputs.size() < 2 ) {
+      throw error( "expecting a chunked jplace file, followed by the abundance maps" );
+    }
+    result.push_back( std::move( job ));
+  }
   return result;
 }
 
 /**
- *  Calculate different diversity metrics based on the given jplace files, output as CSV
+ * Write a result table to a file, see TableWriter.
  */
-int main( int argc, char** argv )
-{
-  // Check if the command line contains the right number of arguments.
-  if( argc < 2 ) {
-    throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <jplace-files...>\n" );
+void write_table_file(
+  std::string const& file,
+  std::vector< std::string > const& key_columns,
+  std::vector< std::string > const& value_columns,
+  TableFormat const& format,
+  std::vector< std::string > const& keys,
+  std::vector< std::vector< double > > const& rows
+) {
+  ProfileTimer const timer( "write_results" );
+  std::ofstream out( file, std::ios::binary );
+  TableWriter table( key_columns, value_columns, format, out );
+  table.add_rows( keys, rows );
+  table.finish();
+  if( not out ) {
+    throw std::runtime_error( "Cannot write " + file );
   }
+}
 
+/**
+ * Batch mode: run all jobs of a manifest (see read_manifest()) in one process, as one graph of
+ * parse, convert and compute tasks on @p threads threads, see TaskGraph.
+ *
+ * Each jplace file is parsed and converted to its query counts and placement masses only once,
+ * even if several jobs use it, and the parsed sample is freed right after. The reference tree of
+ * a job is built once from its first file, and is shared by all files that the job is the first
+ * one to use. The metrics of each file are a task of their own, so that one large data set does
+ * not keep the other threads waiting. The distance matrix of a beta job is a single task.
+ */
+void run_manifest(
+  std::string const& manifest_file,
+  MetricSet const& metrics,
+  MetricSet const& scrapp_metrics,
+  PlacementFilter const& filter,
+  TableFormat const& format,
+  size_t const threads
+) {
+  auto const jobs = read_manifest( manifest_file );
+  TaskGraph graph;
+
+  struct Reference
+  {
+    FlatTree flat_tree;
+    std::unique_ptr< SparseTree > sparse_tree;
+    size_t task = 0;
+  };
+  struct JplaceInput
+  {
+    Sample sample;
+    Reference const* reference = nullptr;
+    bool needs_masses  = false;
+    size_t parse_task   = 0;
+    size_t convert_task = 0;
+
+    SparseMasses counts;
+    double total_count = 0.0;
+    SparseMasses masses;
+  };
+  struct ChunkedInput
+  {
+    ChunkedPlacements chunked;
+    std::unique_ptr< SparseTree > sparse_tree;
+  };
+  struct JobResult
+  {
+    std::vector< std::string > keys;
+    std::vector< std::vector< double > > rows;
+  };
+
+  // the jplace files of all jobs, in order of their first use, with the reference tree of the job
+  // that uses them first. the map nodes stay in place, so that the tasks can refer to them.
   std::vector< std::string > jplace_files;
-  for( int i = 1; i < argc; ++i ) {
-    jplace_files.emplace_back( argv[ i ] );
+  std::map< std::string, JplaceInput > jplace_inputs;
+  std::map< std::string, Reference > references;
+  for( auto const& job : jobs ) {
+    if( job.family != "bwpd" and job.family != "beta" ) {
+      continue;
+    }
+    auto& reference = references[ job.inputs[0] ];
+    for( auto const& file : job.inputs ) {
+      auto& input = jplace_inputs[ file ];
+      if( not input.reference ) {
+        input.reference = &reference;
+        jplace_files.push_back( file );
+      }
+      input.needs_masses = input.needs_masses or job.family == "bwpd";
+    }
   }
-  SampleSet samples = JplaceReader().read( from_files( jplace_files ) );
 
-  std::vector< double > theta_set = { 0.0, 0.25, 0.5, 0.75, 1.0 };
+  for( auto const& file : jplace_files ) {
+    auto& input = jplace_inputs[ file ];
+    input.parse_task = graph.add( [&input, &file](){
+      ProfileSample const profile_sample( sample_name( file ));
+      input.sample = read_jplace( file );
+    });
+  }
+  for( auto& entry : references ) {
+    auto& reference = entry.second;
+    auto const& first = jplace_inputs[ entry.first ];
+    reference.task = graph.add( [&reference, &first](){
+      ProfileTimer const timer( "make_flat_tree" );
+      reference.flat_tree   = make_flat_tree< PlacementEdgeData >( first.sample.tree() );
+      reference.sparse_tree = std::unique_ptr< SparseTree >( new SparseTree( reference.flat_tree ));
+    }, { first.parse_task });
+  }
+  for( auto const& file : jplace_files ) {
+    auto& input = jplace_inputs[ file ];
 
-  // write the header
-  std::cout << "sample,phylo_entropy,quadratic";
-  for( auto const theta : theta_set ) {
-    std::cout << ",bwpd_" << theta;
+    // the sample is freed after the conversion, so also wait for the reference tree built from it
+    std::vector< size_t > dependencies = { input.parse_task, input.reference->task };
+    if( references.count( file )) {
+      dependencies.push_back( references[ file ].task );
+    }
+    input.convert_task = graph.add( [&input, &file, &filter](){
+      ProfileSample const profile_sample( sample_name( file ));
+      auto const& flat_tree = input.reference->flat_tree;
+      check_reference_tree( input.sample, flat_tree );
+      {
+        ProfileTimer const timer( "query_counts" );
+        input.counts      = query_counts( input.sample, flat_tree, filter );
+        input.total_count = num_queries( input.sample );
+      }
+      if( input.needs_masses ) {
+        normalize_weight_ratios( input.sample );
+        static thread_local FlatMassBuilder builder;
+        static thread_local FlatMasses masses;
+        static thread_local std::vector< double > mass_per_edge;
+        placement_masses( input.sample, flat_tree, true, builder, masses );
+        masses.edge_masses( mass_per_edge );
+        for( size_t pos = 0; pos < mass_per_edge.size(); ++pos ) {
+          if( mass_per_edge[ pos ] != 0.0 ) {
+            input.masses.add( pos, mass_per_edge[ pos ] );
+          }
+        }
+      }
+      input.sample = Sample();
+    }, dependencies );
   }
-  std::cout << "\n";
 
-  for( size_t i = 0; i < samples.size(); ++i ) {
-    std::cout << samples.name_at( i );
-    auto const& sample = samples[ i ];
-    // double const n = num_queries( sample );
+  // per job, the compute tasks fill in its rows, and the last task writes them
+  std::vector< JobResult > results( jobs.size() );
+  std::vector< std::unique_ptr< ChunkedInput >> chunked_inputs;
+  for( size_t j = 0; j < jobs.size(); ++j ) {
+    auto const& job = jobs[ j ];
+    auto& result = results[ j ];
+    std::vector< size_t > row_tasks;
+
+    if( job.family == "bwpd" ) {
+      result.keys.resize( job.inputs.size() );
+      result.rows.resize( job.inputs.size() );
+      for( size_t i = 0; i < job.inputs.size(); ++i ) {
+        auto const& input = jplace_inputs[ job.inputs[ i ]];
+        row_tasks.push_back( graph.add( [&job, &result, &input, &metrics, i](){
+          ProfileSample const profile_sample( sample_name( job.inputs[ i ] ));
+          auto const& sparse_tree = *input.reference->sparse_tree;
+          MetricAccumulator counts( metrics );
+          MetricAccumulator masses( metrics );
+          {
+            ProfileTimer const timer( "bwpd_counts" );
+            BWPD( sparse_tree, input.counts, input.total_count, counts );
+          }
+          {
+            ProfileTimer const timer( "bwpd_masses" );
+            BWPD( sparse_tree, input.masses, 1.0, masses );
+          }
+          result.keys[ i ] = sample_name( job.inputs[ i ] );
+          result.rows[ i ] = join_rows( counts.row(), masses.row() );
+        }, { input.convert_task }));
+      }
+      graph.add( [&job, &result, &metrics, &format](){
+        write_table_file( job.output, { "sample" }, count_and_mass_names( metrics ), format, result.keys, result.rows );
+      }, row_tasks );
+
+    } else if( job.family == "beta" ) {
+      for( auto const& file : job.inputs ) {
+        row_tasks.push_back( jplace_inputs[ file ].convert_task );
+      }
+      auto const& reference = references[ job.inputs[0] ];
+      std::vector< JplaceInput const* > inputs;
+      for( auto const& file : job.inputs ) {
+        inputs.push_back( &jplace_inputs[ file ] );
+      }
+      graph.add( [&job, &result, &reference, inputs, &format](){
+        std::vector< SparseMasses > counts;
+        std::vector< double > totals;
+        for( size_t i = 0; i < inputs.size(); ++i ) {
+          if( inputs[ i ]->reference->flat_tree.size() != reference.flat_tree.size() ) {
+            throw std::runtime_error( "jplace files are not placed on the same reference tree!" );
+          }
+          result.keys.push_back( sample_name( job.inputs[ i ] ));
+          counts.push_back( inputs[ i ]->counts );
+          totals.push_back( inputs[ i ]->total_count );
+        }
+        check_beta_totals( result.keys, totals );
+
+        ProfileTimer const timer( "pairwise_distances" );
+        auto const distances = pairwise_distances( reference.flat_tree, counts, totals );
+        auto const size = result.keys.size();
+        for( size_t i = 0; i < size; ++i ) {
+          result.rows.emplace_back( distances.begin() + i * size, distances.begin() + ( i + 1 ) * size );
+        }
+        write_table_file( job.output, { "sample" }, result.keys, format, result.keys, result.rows );
+      }, row_tasks );
+
+    } else if( job.family == "chunked" ) {
+      chunked_inputs.emplace_back( new ChunkedInput() );
+      auto& input = *chunked_inputs.back();
+      auto const parse_task = graph.add( [&job, &input](){
+        auto chunk = read_jplace( job.inputs[0] );
+        ProfileTimer const timer( "make_chunked_placements" );
+        input.chunked     = make_chunked_placements( chunk );
+        input.sparse_tree = std::unique_ptr< SparseTree >( new SparseTree( input.chunked.flat_tree ));
+      });
+      result.keys.resize( job.inputs.size() - 1 );
+      result.rows.resize( job.inputs.size() - 1 );
+      for( size_t i = 0; i + 1 < job.inputs.size(); ++i ) {
+        row_tasks.push_back( graph.add( [&job, &result, &input, &metrics, &filter, i](){
+          result.keys[ i ] = abundance_map_sample_name( job.inputs[ i + 1 ] );
+          result.rows[ i ] = chunked_row( input.chunked, *input.sparse_tree, job.inputs[ i + 1 ], metrics, filter );
+        }, { parse_task }));
+      }
+      graph.add( [&job, &result, &metrics, &format](){
+        write_table_file( job.output, { "sample" }, count_and_mass_names( metrics ), format, result.keys, result.rows );
+      }, row_tasks );
+
+    } else {
+      // the metrics of scrapp-diversity
+      auto const columns = metric_names( scrapp_metrics );
+
+      result.keys.resize( job.inputs.size() );
+      result.rows.resize( job.inputs.size() );
+      for( size_t i = 0; i < job.inputs.size(); ++i ) {
+        row_tasks.push_back( graph.add( [&job, &result, &scrapp_metrics, i](){
+          result.keys[ i ] = file_basename( file_path( job.inputs[ i ] ));
+          ProfileSample const profile_sample( result.keys[ i ] );
+
+          static thread_local ScrappTreeReader reader;
+          static thread_local FlatTree flat_tree;
+          static thread_local FlatMasses masses;
+          {
+            ProfileTimer const timer( "read_nhx" );
+            reader.read( job.inputs[ i ], flat_tree, masses );
+            Profile::global().count( "bytes_read", input_file_size( job.inputs[ i ] ));
+          }
+          ProfileTimer const timer( "flat_mass_bwpd" );
+          MetricAccumulator accumulator( scrapp_metrics );
+          FlatMassBWPD( flat_tree, masses, accumulator );
+          result.rows[ i ] = accumulator.row();
+        }));
+      }
+      graph.add( [&job, &result, columns, &format](){
+        write_table_file( job.output, { "sample" }, columns, format, result.keys, result.rows );
+      }, row_tasks );
+    }
+  }
 
-    // Phylogenetic Entropy
-    std::cout << "," << -BWPD( sample, phylo_entropy_g );
+  graph.run( threads );
+}
 
-    // Phylogenetic Quadratic Entropy
-    std::cout << "," << BWPD( sample, phylo_quad_entropy_g );
+/**
+ * Server mode: load the reference tree once from @p reference_file (any jplace file placed on it),
+ * and answer requests for the count based metrics of single samples, one line each, see LineServer:
+ *
+ *     header                                   the CSV header of the replies
+ *     masses <name> <total> <edge_num>:<count> ...
+ *                                              query counts per jplace edge_num, and the total
+ *                                              number of queries, including unplaced ones
+ *     jplace <name> <document>                 a whole jplace document, with its line breaks
+ *                                              replaced by spaces
+ *
+ * Each reply is the CSV row of the sample. It only holds the count based metrics, as in the
+ * header, not the `mass_` columns of the batch mode, for both kinds of requests. The counts of a
+ * masses request can not add up to more than its total. The edge mass lists only cost the sparse
+ * evaluation, while jplace documents still need to be parsed, including their copy of the tree.
+ */
+void run_server(
+  std::string const& reference_file,
+  std::string const& socket_path,
+  MetricSet const& metrics,
+  PlacementFilter const& filter
+) {
+  auto const reference = read_jplace( reference_file );
+  auto const flat_tree = make_flat_tree< PlacementEdgeData >( reference.tree() );
+  SparseTree const sparse_tree( flat_tree );
+  std::unordered_map< long, size_t > edge_num_position;
+  for( size_t pos = 0; pos < flat_tree.size(); ++pos ) {
+    auto const& edge_data = reference.tree().edge_at( flat_tree.edge_index[ pos ] ).data< PlacementEdgeData >();
+    edge_num_position[ edge_data.edge_num() ] = pos;
+  }
 
-    // BWPD
-    for( auto const theta : theta_set ) {
-      std::cout << "," << BWPD( sample, step_function_g, theta );
+  LineServer server( [&]( std::string const& request ) -> std::string {
+    std::istringstream in( request );
+    std::string command;
+    std::string name;
+    in >> command;
+    std::ostringstream out;
+    if( command == "header" ) {
+      write_header( metrics, out );
+    } else if( command == "masses" ) {
+      double total = 0.0;
+      if( not ( in >> name >> total ) or not std::isfinite( total ) or total <= 0.0 ) {
+        throw std::runtime_error( "expecting masses <name> <total> <edge_num>:<count> ..." );
+      }
+      SparseMasses counts;
+      double sum = 0.0;
+      std::string entry;
+      while( in >> entry ) {
+        char* end = nullptr;
+        auto const edge_num = std::strtol( entry.c_str(), &end, 10 );
+        auto const it = edge_num_position.find( edge_num );
+        if( end == entry.c_str() or *end != ':' or it == edge_num_position.end() ) {
+          throw std::runtime_error( "invalid or unknown edge in '" + entry + "'" );
+        }
+        char* count_end = nullptr;
+        auto const count = std::strtod( end + 1, &count_end );
+        if( count_end == end + 1 or *count_end != '\0' or not std::isfinite( count ) or count < 0.0 ) {
+          throw std::runtime_error( "invalid count in '" + entry + "'" );
+        }
+        counts.add( it->second, count );
+        sum += count;
+      }
+      if( sum > total and not equals_approx( sum / total, 1.0 )) {
+        throw std::runtime_error( "the counts add up to more than the total of " + name );
+      }
+      normalize_sparse_masses( counts );
+      MetricAccumulator accumulator( metrics );
+      BWPD( sparse_tree, counts, total, accumulator );
+      write_row( name, accumulator.row(), out );
+    } else if( command == "jplace" ) {
+      in >> name;
+      std::string document;
+      std::getline( in, document );
+      auto const sample = JplaceReader().read( from_string( document ));
+      check_reference_tree( sample, flat_tree );
+      write_row( name, count_row( sample, sparse_tree, metrics, filter ), out );
+    } else {
+      throw std::runtime_error( "unknown request '" + command + "'" );
     }
-    std::cout << "\n";
+
+    auto reply = out.str();
+    reply.pop_back();
+    return reply;
+  });
+
+  if( socket_path.empty() ) {
+    server.serve_stdio();
+  } else {
+    server.serve_socket( socket_path );
   }
+}
 
-  // trying with the mass_tree
-  // write the header
-  std::cout << "sample,phylo_entropy,quadratic";
-  for( auto const theta : theta_set ) {
-    std::cout << ",bwpd_" << theta;
+/**
+ *  Calculate different diversity metrics based on the given jplace files, output as CSV
+ */
+int main( int argc, char** argv )
+{
+  CommandLine const options( argc, argv, { "threads", "prefetch", "chunked", "theta-grid", "replicates", "depths", "seed", "profile", "cache", "lwr-cutoff", "lwr-top-k", "shard", "merge", "serve", "socket", "layout", "manifest", "metrics" }, { "stream", "beta", "lwr-weighted", "incremental", "clades", "binary" } );
+
+  // Check if the command line contains the right number of arguments.
+  if( options.positionals().empty() and not options.has( "serve" ) and not options.has( "manifest" )
+      and not ( options.has( "cache" ) and file_exists( options.get( "cache" ) ))
+  ) {
+    throw std::runtime_error(
+        std::string( "Usage: " ) + argv[ 0 ] +
+        " [--threads N] [--stream [--prefetch K]] <jplace-files...>\n" +
+        "       " + argv[ 0 ] + " [--threads N] --chunked <epa_result.jplace> <abundance-maps...>\n" +
+        "Use --incremental to treat the jplace files as successive batches of one sample, with a row of\n" +
+        "count based metrics after each batch. A file given as remove:<file> removes that batch again.\n" +
+        "Only entropy, quadratic, faith, bwpd:0 and hill:0/1/2 are updated by deltas, select them with\n" +
+        "--metrics for the fastest updates; any other metric evaluates all occupied edges per batch.\n" +
+        "Use --clades to compute the metrics of every clade of the reference tree, renormalized to its mass.\n" +
+        "Use --beta to compute the pairwise weighted UniFrac (KR) distance matrix instead.\n" +
+        "Use --replicates B [--depths d1,d2,...] [--seed S] for bootstrap (or, with depths, rarefaction)\n" +
+        "confidence intervals of the count based metrics instead.\n" +
+        "Use --lwr-weighted [--lwr-cutoff X] [--lwr-top-k K] to spread the query counts over all placements\n" +
+        "of a pquery by their like weight ratio, instead of counting the best hit only. The cutoff applies\n" +
+        "to the ratios normalized per pquery, in every mode.\n" +
+        "Use --cache file.bin to evaluate from a binary cache of the samples, built on the first run.\n" +
+        "The jplace files can be gzipped (.jplace.gz, or bgzip for parallel decompression).\n" +
+        "Use --shard i/N to only process shard i (0 <= i < N) of the input files, balanced by file size,\n" +
+        "and --merge out0.csv,out1.csv,... with the same input files and options to combine the shard outputs.\n" +
+        "Use --serve <reference.jplace> [--socket path] to answer requests for single samples on stdin\n" +
+        "(or a Unix domain socket), keeping the reference tree loaded. The replies only hold the count\n" +
+        "based metrics, without the mass_ columns of the batch mode, also for jplace requests.\n" +
+        "Use --manifest jobs.txt to run many jobs (lines of <bwpd|beta|chunked|scrapp> <output> <inputs...>)\n" +
+        "in one process, parsing every input file only once.\n" +
+        "Use --layout long to write one row per sample and metric instead of one column per metric, and\n" +
+        "--binary to write a binary column file instead of CSV, see evaluation/read_columns.r.\n" +
+        "Use --profile out.json to write a per-phase and per-sample timing breakdown. Allocations are\n" +
+        "only counted in it when built with the CMake option APPS_COUNT_ALLOCATIONS.\n" +
+        "Use --metrics name[:parameter],... (for example entropy,bwpd:0.5,hill:2) to select the metrics,\n" +
+        "instead of both entropies and BWPD with thetas 0, 0.25, 0.5, 0.75 and 1. Available metrics:\n" +
+        metric_registry_help() +
+        "Use --theta-grid from:to:steps to evaluate BWPD on a grid of thetas instead of the default ones.\n" );
+  }
+  auto const threads = options.get_size_t( "threads", 1 );
+  set_num_threads( threads );
+  if( options.has( "profile" ) ) {
+    Profile::global().enable();
   }
-  std::cout << "\n";
 
-  for( size_t i = 0; i < samples.size(); ++i ) {
-    std::cout << samples.name_at( i );
-    auto& sample = samples[ i ];
-    // double const n = num_queries( sample );
+  std::vector< double > theta_set = { 0.0, 0.25, 0.5, 0.75, 1.0 };
+  auto metrics        = default_metric_set( theta_set );
+  auto scrapp_metrics = scrapp_metric_set( theta_set );
+  if( options.has( "theta-grid" ) ) {
+    metrics        = default_metric_set( {} );
+    scrapp_metrics = scrapp_metric_set( {} );
+    metrics.grid        = parse_theta_grid( options.get( "theta-grid" ) );
+    scrapp_metrics.grid = metrics.grid;
+  }
+  if( options.has( "metrics" ) ) {
+    metrics.specs        = parse_metric_list( options.get( "metrics" ) );
+    scrapp_metrics.specs = metrics.specs;
+  }
+  check_metric_names( metrics );
+  check_metric_names( scrapp_metrics );
 
-    normalize_weight_ratios( sample );
+  auto const format = parse_table_format( options.get( "layout", "wide" ), options.has( "binary" ));
 
-    auto mass_tree = convert_sample_to_mass_tree( sample, true ).first;
-    // MassTreeBWPD( mass_tree, step_function_g, 1.0 );
-    // break;
+  // combine the outputs of sharded runs, given the inputs of the whole run for the sample order
+  if( options.has( "merge" ) ) {
+    if( format.binary ) {
+      throw std::runtime_error( "--merge combines CSV outputs, and can not write --binary." );
+    }
+    std::vector< std::string > names;
+    for( auto const& file : options.positionals() ) {
+      names.push_back( options.has( "chunked" ) ? abundance_map_sample_name( file ) : sample_name( file ));
+    }
+    // the resampling and clade modes leave out samples without enough queries or mass
+    auto const allow_missing = options.has( "replicates" ) or options.has( "clades" );
+    merge_shard_outputs( options.get_list( "merge" ), names, allow_missing, std::cout );
+    return 0;
+  }
 
-    // Phylogenetic Entropy
-    std::cout << "," << -MassTreeBWPD( mass_tree, phylo_entropy_g );
+  // the modes exclude each other, and --chunked only changes the input of some of them
+  std::string mode;
+  for( auto const& name : { "manifest", "serve", "replicates", "beta", "cache", "clades", "incremental", "stream" } ) {
+    if( not options.has( name ) ) {
+      continue;
+    }
+    if( not mode.empty() ) {
+      throw std::runtime_error( "--" + mode + " can not be combined with --" + name + "." );
+    }
+    mode = name;
+  }
+  if( options.has( "chunked" ) and not ( mode.empty() or mode == "replicates" or mode == "beta" or mode == "cache" )) {
+    throw std::runtime_error( "--chunked can not be combined with --" + mode + "." );
+  }
+  if( options.has( "socket" ) and mode != "serve" ) {
+    throw std::runtime_error( "--socket needs --serve." );
+  }
+  if(( options.has( "depths" ) or options.has( "seed" )) and mode != "replicates" ) {
+    throw std::runtime_error( "--depths and --seed need --replicates." );
+  }
 
-    // Phylogenetic Quadratic Entropy
-    std::cout << "," << MassTreeBWPD( mass_tree, phylo_quad_entropy_g );
+  // only the inputs of this shard, all modes with one result per sample can be sharded
+  auto files = options.positionals();
+  if( options.has( "shard" ) ) {
+    if( options.has( "beta" ) or options.has( "incremental" ) ) {
+      throw std::runtime_error( "--shard can not be combined with --beta or --incremental." );
+    }
+    files = shard_files( files, parse_shard( options.get( "shard" ) ));
+  }
 
-    // BWPD
-    for( auto const theta : theta_set ) {
-      std::cout << "," << MassTreeBWPD( mass_tree, step_function_g, theta );
+  PlacementFilter filter;
+  if( options.has( "lwr-weighted" ) ) {
+    filter.cutoff = options.get_double( "lwr-cutoff", 0.0 );
+    filter.top_k  = options.get_size_t( "lwr-top-k", 0 );
+    if( options.has( "replicates" ) or options.has( "cache" ) ) {
+      throw std::runtime_error( "--lwr-weighted can not be combined with --replicates or --cache." );
     }
-    std::cout << "\n";
+  } else if( options.has( "lwr-cutoff" ) or options.has( "lwr-top-k" ) ) {
+    throw std::runtime_error( "--lwr-cutoff and --lwr-top-k need --lwr-weighted." );
   }
 
+  if( options.has( "manifest" ) ) {
+    run_manifest( options.get( "manifest" ), metrics, scrapp_metrics, filter, format, threads );
+  } else if( options.has( "serve" ) ) {
+    run_server( options.get( "serve" ), options.get( "socket" ), metrics, filter );
+  } else if( options.has( "replicates" ) ) {
+    run_resample(
+      files, options.get( "chunked" ), metrics, format,
+      options.get_size_t( "replicates", 100 ), options.get_size_t_list( "depths" ),
+      options.get_size_t( "seed", 42 ), options.get_size_t( "prefetch", 0 ), threads
+    );
+  } else if( options.has( "beta" ) ) {
+    run_beta( files, options.get( "chunked" ), filter, format, options.get_size_t( "prefetch", 0 ), threads );
+  } else if( options.has( "cache" ) ) {
+    run_cached(
+      files, options.get( "chunked" ), options.get( "cache" ), metrics, format,
+      options.get_size_t( "prefetch", 0 ), threads
+    );
+  } else if( options.has( "chunked" ) ) {
+    run_chunked( options.get( "chunked" ), files, metrics, filter, format );
+  } else if( options.has( "clades" ) ) {
+    run_clades( files, metrics, filter, format, options.get_size_t( "prefetch", 0 ), threads );
+  } else if( options.has( "incremental" ) ) {
+    run_incremental( files, metrics, filter, format, options.get_size_t( "prefetch", 0 ), threads );
+  } else if( options.has( "stream" ) ) {
+    run_stream( files, metrics, filter, format, options.get_size_t( "prefetch", 0 ), threads );
+  } else {
+    run_sample_set( files, metrics, filter, format );
+  }
+
+  if( options.has( "profile" ) ) {
+    Profile::global().write( options.get( "profile" ) );
+  }
   return 0;
 }